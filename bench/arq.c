@@ -0,0 +1,169 @@
+/*
+ * libtrivdl benchmark: ARQ goodput vs window size over a noisy link.
+ * Two lines talk through a link emulator (rate, delay, bit errors)
+ * built of two pty pairs.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+#include "libtrivdl.h"
+#include "reactor.h"
+#include "arq.h"
+#include "bench.h"
+#include <stdlib.h>
+#include <poll.h>
+#include <pthread.h>
+
+#define MSGS        400         // per run
+#define RATE        100000.0    // link, bytes/s (1 Mbaud 8N1)
+#define DELAY       0.002       // link, one way, s
+#define RTO         0.05
+
+// link emulator, one direction
+#define CHUNKS      1024
+typedef struct {
+    int in, out;
+    double ber;         // probability of a bit flip per byte
+    unsigned seed;
+    volatile int stop;
+    double busy_until;
+    int head, count;
+    struct {
+        double at;
+        int len;
+        uc data[256];
+    } q[CHUNKS];
+} t_link;
+
+void* link_run (void* arg)
+{
+    t_link* l = arg;
+    struct pollfd pfd;
+    double t;
+    int ms, n, i;
+
+    pfd.fd = l->in;
+    pfd.events = POLLIN;
+    while (!l->stop) {
+        t = now ();
+        // deliver due chunks
+        while (l->count && l->q[l->head].at <= t) {
+            n = write (l->out, l->q[l->head].data, l->q[l->head].len);
+            (void)n;
+            l->head = (l->head + 1) % CHUNKS;
+            l->count--;
+        }
+        ms = l->count ? (int)((l->q[l->head].at - t) * 1e3) + 1 : 10;
+        if (l->count == CHUNKS) {
+            poll (NULL, 0, ms);
+            continue;
+        }
+        if (poll (&pfd, 1, ms) <= 0)
+            continue;
+        i = (l->head + l->count) % CHUNKS;
+        n = read (l->in, l->q[i].data, sizeof(l->q[i].data));
+        if (n <= 0)
+            continue;
+        for (l->q[i].len = n, n = 0; n < l->q[i].len; n++)
+            if (rand_r (&l->seed) < l->ber * RAND_MAX)
+                l->q[i].data[n] ^= 1 << (rand_r (&l->seed) % 8);
+        t = now ();
+        if (l->busy_until < t)
+            l->busy_until = t;
+        l->busy_until += l->q[i].len / RATE;
+        l->q[i].at = l->busy_until + DELAY;
+        l->count++;
+    }
+    return NULL;
+}
+
+t_reactor r;
+int queued;     // messages given to sender
+
+void cb_msg_rx (t_arq* a, uc* msg, int len)
+{
+}
+
+void cb_msg_acked (t_arq* a, int n)
+{
+    uc pl[ARQ_MAXMSG];
+    int m;
+    for (m = 0; m < ARQ_MAXMSG; m++)
+        pl[m] = (uc)rand();
+    while (queued < MSGS && arq_send (a, pl, ARQ_MAXMSG))
+        queued++;
+    if (queued == MSGS && !arq_inflight (a))
+        r.rflags |= EXIT_A_M;
+}
+
+t_arq_callbacks callbacks = { cb_msg_rx, cb_msg_acked };
+
+static t_link fwd, back;
+
+void run (int window, double ber)
+{
+    int a1, a2, b1, b2;
+    t_line la, lb;
+    t_arq sender, receiver;
+    pthread_t th1, th2;
+    double t;
+
+    open_pair (&a1, &a2);
+    open_pair (&b1, &b2);
+    fcntl (a2, F_SETFL, fcntl (a2, F_GETFL) | O_NONBLOCK);
+    fcntl (b2, F_SETFL, fcntl (b2, F_GETFL) | O_NONBLOCK);
+    memset (&fwd, 0, sizeof(fwd));
+    memset (&back, 0, sizeof(back));
+    fwd.in = a1; fwd.out = b1; fwd.ber = ber; fwd.seed = 1;
+    back.in = b1; back.out = a1; back.ber = ber; back.seed = 2;
+    pthread_create (&th1, NULL, link_run, &fwd);
+    pthread_create (&th2, NULL, link_run, &back);
+
+    init_line (&la, NULL, NULL, NULL);
+    la.fd = a2;
+    la.lflags = TXFRAME;
+    init_line (&lb, NULL, NULL, NULL);
+    lb.fd = b2;
+    lb.lflags = TXFRAME;
+    init_arq (&sender, &la, window, RTO, &callbacks, NULL);
+    init_arq (&receiver, &lb, window, RTO, &callbacks, NULL);
+    init_reactor (&r);
+    reactor_add_line (&r, &la);
+    reactor_add_line (&r, &lb);
+
+    queued = 0;
+    t = now ();
+    cb_msg_acked (&sender, 0); // fill the window
+    reactor_update_line (&r, &la);
+    reactor_run (&r);
+    t = now () - t;
+
+    fwd.stop = back.stop = 1;
+    pthread_join (th1, NULL);
+    pthread_join (th2, NULL);
+    close_reactor (&r);
+    close (a1); close (a2); close (b1); close (b2);
+    msg ("%7d %8.0e %10.0f %7.1f%% %8lu %8lu %8lu %s\n", window, ber,
+            receiver.delivered * ARQ_MAXMSG / t,
+            100.0 * receiver.delivered * ARQ_MAXMSG / t / RATE,
+            sender.resent, sender.timeouts, receiver.dups,
+            receiver.delivered == MSGS ? "" : "INCOMPLETE");
+}
+
+int main ()
+{
+    int windows[] = {1, 2, 4, 8, 16, 32};
+    double bers[] = {0, 1e-3, 1e-2};
+    int w, b;
+
+    msg ("%d messages of %d bytes per run, link %.0f B/s, delay %.0f ms, rto %.0f ms\n",
+            MSGS, ARQ_MAXMSG, RATE, DELAY * 1e3, RTO * 1e3);
+    msg (" window  bit err/B  goodput B/s  of link  resent timeouts     dups\n");
+    for (b = 0; b < 3; b++)
+        for (w = 0; w < 6; w++)
+            if (windows[w] <= ARQ_MAXWIN)
+                run (windows[w], bers[b]);
+    return 0;
+}
@@ -0,0 +1,42 @@
+/*
+ * helper object for benchmarks
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <pty.h>
+#include <sys/socket.h>
+
+#include "bench.h"
+
+
+double now ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+int open_pair (int* a, int* b)
+{
+    struct termios tty;
+    int sv[2];
+
+    memset (&tty, 0, sizeof(tty));
+    cfmakeraw (&tty);
+    tty.c_cc[VMIN] = 1;
+    tty.c_cc[VTIME] = 0;
+    if (openpty (a, b, NULL, &tty, NULL) == 0)
+        return 0;
+    fprintf (stderr, "openpty: %s, falling back to socketpair\n", strerror(errno));
+    if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        fprintf (stderr, "socketpair: %s\n", strerror(errno));
+        return -1;
+    }
+    *a = sv[0];
+    *b = sv[1];
+    return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// monotonic time in seconds
+double now ();
+// connected pair of raw ttys (pty master and slave), or socketpair
+// if pty is not available. returns 0 on success
+int open_pair (int* a, int* b);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
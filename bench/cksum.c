@@ -0,0 +1,79 @@
+/*
+ * libtrivdl benchmark: checksum options, additive sum vs CRC-16 vs CRC-32C.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+#include "libtrivdl.h"
+#include "bench.h"
+#include <stdlib.h>
+
+#define BUFSIZE     (1 << 16)
+#define TOTAL       (1 << 28)   // bytes per measurement
+
+uc buf[BUFSIZE];
+volatile uint32_t sink;
+
+// the same loop as CHECKSUM == CK_SUM in library
+uc sum_update (uc cs, const uc* p, int n)
+{
+    while (n-- > 0)
+        cs += *p++;
+    return cs;
+}
+
+// bytes per ns, checksum of n-byte blocks
+double by_sum (int n)
+{
+    int i, off = 0;
+    uc cs = 0;
+    double t = now ();
+    for (i = 0; i < TOTAL / n; i++) {
+        cs = sum_update (cs, buf + off, n);
+        off = (off + n) % (BUFSIZE - n);
+    }
+    sink = cs;
+    return (double)TOTAL / ((now () - t) * 1e9);
+}
+
+double by_crc16 (int n)
+{
+    int i, off = 0;
+    uint16_t crc = 0xFFFF;
+    double t = now ();
+    for (i = 0; i < TOTAL / n; i++) {
+        crc = crc16_update (crc, buf + off, n);
+        off = (off + n) % (BUFSIZE - n);
+    }
+    sink = crc;
+    return (double)TOTAL / ((now () - t) * 1e9);
+}
+
+double by_crc32c (int n)
+{
+    int i, off = 0;
+    uint32_t crc = 0xFFFFFFFF;
+    double t = now ();
+    for (i = 0; i < TOTAL / n; i++) {
+        crc = crc32c_update (crc, buf + off, n);
+        off = (off + n) % (BUFSIZE - n);
+    }
+    sink = crc;
+    return (double)TOTAL / ((now () - t) * 1e9);
+}
+
+int main ()
+{
+    int sizes[] = {1, 16, 64, 1024, 4096};
+    int i;
+
+    for (i = 0; i < BUFSIZE; i++)
+        buf[i] = (uc)rand();
+    msg ("block, bytes   bytes/ns: sum   CRC-16  CRC-32C\n");
+    for (i = 0; i < 5; i++)
+        msg ("%12d %14.3f %8.3f %8.3f\n", sizes[i],
+                by_sum (sizes[i]), by_crc16 (sizes[i]), by_crc32c (sizes[i]));
+    return 0;
+}
@@ -0,0 +1,251 @@
+/*
+ * libtrivdl benchmark: request/response transactions on line pairs of
+ * one reactor, written as callbacks and as coroutines (coro.hpp), with
+ * 1 and more transactions in flight per line.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+#include "coro.hpp"
+#include "bench.h"
+#include <stdlib.h>
+#include <sys/resource.h>
+
+#define TXNS    20000   // transactions per client line
+#define MAXPAIRS 16
+#define REQSIZE 16
+
+using namespace trivdl;
+
+t_reactor r;
+int active;             // client lines (or tasks) not done
+int lost, bad;
+
+double cpu_time ()
+{
+    struct rusage ru;
+    getrusage (RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6
+        + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+}
+
+// request: transaction number, then filler
+void fill_req (uc* req, int txn)
+{
+    memset (req, 0x5A, REQSIZE);
+    memcpy (req, &txn, sizeof(txn));
+}
+
+
+// callbacks: client keeps inflight requests out, server echoes,
+// holding rx frame while its reply is going out
+typedef struct {
+    bool server;
+    int inflight, window;
+    int sent, done;
+} t_userdata;
+
+#define UD      ((t_userdata*)(line->userdata))->
+
+void client_send (t_line* line)
+{
+    uc req[REQSIZE];
+    if ((LWFLAGS & READY) || UD sent >= TXNS || UD inflight >= UD window)
+        return;
+    fill_req (req, UD sent);
+    build_frame (LWFR, req, REQSIZE);
+    LWFLAGS |= READY;
+    UD sent++;
+    UD inflight++;
+}
+
+void echo (t_line* line)
+{
+    build_frame (LWFR, &LRMSG, LRMSGLEN);
+    LWFLAGS |= READY;
+    LRNEXT = 0;
+    LRFLAGS &= ~READY;
+}
+
+void cb_frame_rx_done (uc status, t_line* line)
+{
+    if (status != FROK) {
+        bad++;
+        LRNEXT = 0;
+        LRFLAGS &= ~READY;
+        return;
+    }
+    if (UD server) {
+        if (!(LWFLAGS & READY))
+            echo (line);
+        return;
+    }
+    UD done++;
+    UD inflight--;
+    LRNEXT = 0;
+    LRFLAGS &= ~READY;
+    if (UD done == TXNS && --active == 0)
+        r.rflags |= EXIT_A_M;
+    client_send (line);
+}
+
+void cb_frame_tx_done (uc, t_line* line)
+{
+    if (UD server) {
+        if (LRFLAGS & READY)
+            echo (line);
+        return;
+    }
+    client_send (line);
+}
+
+float cb_idle (t_line*)
+{
+    return 1.0;
+}
+
+t_callbacks callbacks = { cb_frame_rx_done, cb_frame_tx_done, cb_idle };
+
+
+// coroutines: a task per transaction in flight, one echo task per server
+task client (co_line& l, int txns)
+{
+    uc req[REQSIZE], rep[MAXMSG];
+    int n;
+
+    while (txns-- > 0) {
+        fill_req (req, txns);
+        co_await l.send (req, REQSIZE);
+        n = co_await l.recv (rep, sizeof(rep), 1.0);
+        if (n < 0)
+            lost++;
+        else if (n != REQSIZE || memcmp (req, rep, REQSIZE))
+            bad++;  // reply of another task
+    }
+    if (--active == 0)
+        r.rflags |= EXIT_A_M;
+}
+
+task server (co_line& l)
+{
+    uc buf[MAXMSG];
+    int n;
+
+    for (;;) {
+        n = co_await l.recv (buf, sizeof(buf));
+        co_await l.send (buf, n);
+    }
+}
+
+
+// prints transactions per second, returns lost and bad ones
+int run (bool coro, int pairs, int window)
+{
+    t_line line[2 * MAXPAIRS];
+    t_userdata ud[2 * MAXPAIRS];
+    co_line* cl[2 * MAXPAIRS];
+    int fd[2 * MAXPAIRS], k, t;
+    double tm, cpu;
+    frame_allocator& fa = frame_allocator::local ();
+
+    if (!init_reactor (&r))
+        exit (2);
+    lost = bad = 0;
+    for (k = 0; k < 2 * pairs; k += 2)
+        if (open_pair (fd + k, fd + k + 1))
+            exit (2);
+    for (k = 0; k < 2 * pairs; k++) {
+        fcntl (fd[k], F_SETFL, fcntl (fd[k], F_GETFL) | O_NONBLOCK);
+        init_line (line + k, NULL, ud + k, &callbacks);
+        line[k].fd = fd[k];
+        line[k].lflags = TXFRAME;
+        memset (ud + k, 0, sizeof(ud[k]));
+        ud[k].server = k & 1;
+        ud[k].window = window;
+        reactor_add_line (&r, line + k);
+    }
+    tm = now ();
+    cpu = cpu_time ();
+    if (coro) {
+        active = pairs * window;
+        for (k = 0; k < 2 * pairs; k++) {
+            cl[k] = new co_line (line + k, &r);
+            if (k & 1)
+                server (*cl[k]);
+            else
+                for (t = 0; t < window; t++)
+                    client (*cl[k], TXNS / window);
+        }
+    } else {
+        active = pairs;
+        for (k = 0; k < 2 * pairs; k += 2)
+            client_send (line + k);
+    }
+    reactor_run (&r);
+    tm = now () - tm;
+    cpu = cpu_time () - cpu;
+
+    close_reactor (&r);
+    for (k = 0; k < 2 * pairs; k++) {
+        close (fd[k]);
+        // server tasks are left waiting, their frames stay allocated
+        if (coro)
+            delete cl[k];
+    }
+    msg ("%-10s %5d %6d %10.0f %10.2f %6d %6d", coro ? "coroutines" : "callbacks",
+            pairs, window, pairs * TXNS / tm, cpu * 1e6 / (pairs * TXNS), lost, bad);
+    if (coro) {
+        msg ("   %zu/%zu/%lu", fa.peak, fa.blocks, fa.large);
+    }
+    msg ("\n");
+    return lost + bad;
+}
+
+// recv() on a quiet line times out, sleep() sleeps
+int timeouts ()
+{
+    t_line line;
+    int fd[2], fail = 1;
+    double t;
+
+    if (open_pair (fd, fd + 1) || !init_reactor (&r))
+        exit (2);
+    init_line (&line, NULL, NULL, &callbacks);
+    line.fd = fd[0];
+    reactor_add_line (&r, &line);
+    co_line l (&line, &r);
+    t = now ();
+    [] (co_line& l, int& fail) -> task {
+        uc buf[MAXMSG];
+        int n = co_await l.recv (buf, sizeof(buf), 0.05);
+        co_await l.sleep (0.05);
+        fail = n != -1;
+        r.rflags |= EXIT_A_M;
+    } (l, fail);
+    reactor_run (&r);
+    t = now () - t;
+    msg ("timeout and sleep of 50 ms: %.1f ms%s\n", t * 1e3, fail ? ", FAILED" : "");
+    close_reactor (&r);
+    close (fd[0]);
+    close (fd[1]);
+    return fail || t < 0.1 || t > 0.5;
+}
+
+int main ()
+{
+    static const int runs[][2] = { { 1, 1 }, { 1, 8 }, { MAXPAIRS, 1 }, { MAXPAIRS, 8 } };
+    int i, fail = 0;
+
+    frame_allocator::local ().reserve (MAXPAIRS * 8 + MAXPAIRS);
+    msg ("%d transactions of %d bytes per client line, TXFRAME lines on one reactor\n",
+            TXNS, REQSIZE);
+    msg ("           pairs window     txns/s  CPU us/txn   lost    bad   frames peak/blocks/large\n");
+    for (i = 0; i < 4; i++) {
+        fail |= run (false, runs[i][0], runs[i][1]);
+        fail |= run (true, runs[i][0], runs[i][1]);
+    }
+    fail |= timeouts ();
+    return fail;
+}
@@ -0,0 +1,234 @@
+/*
+ * libtrivdl benchmark: C++ basic_line against the C path, decode and
+ * encode, with C++ and C callbacks, and basic_line of other geometries.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+#include "trivdl.hpp"
+#include "bench.h"
+#include <stdlib.h>
+#include <vector>
+
+#define NFRAMES     1024
+#define ROUNDS      200
+
+using namespace trivdl;
+
+volatile uc sink;
+static int c_ok, c_bad;
+
+// C path
+void cb_frame_rx_done (uc status, t_line* line)
+{
+    if (status == FROK)
+        c_ok++;
+    else
+        c_bad++;
+    LRNEXT = 0;
+    LRFLAGS &= ~READY;
+}
+
+void cb_frame_tx_done (uc, t_line*)
+{
+}
+
+float cb_idle (t_line*)
+{
+    return 1.0;
+}
+
+t_callbacks callbacks = { cb_frame_rx_done, cb_frame_tx_done, cb_idle };
+
+// C++ path, handler the compiler sees through
+template <class Line>
+struct counter {
+    int ok = 0, bad = 0;
+    void frame_rx_done (uc status, Line& line)
+    {
+        if (status == FROK)
+            ok++;
+        else
+            bad++;
+        line.rfr.next = 0;
+        line.rfr.flags &= ~READY;
+    }
+    void frame_tx_done (uc, Line&) {}
+};
+
+// and through C-style pointers
+static int p_ok, p_bad;
+
+void cxx_frame_rx_done (uc status, c_line<>* line)
+{
+    if (status == FROK)
+        p_ok++;
+    else
+        p_bad++;
+    line->rfr.next = 0;
+    line->rfr.flags &= ~READY;
+}
+
+// random payloads, a few delimiters in them
+std::vector<uc> payload (int n)
+{
+    std::vector<uc> p (n);
+    for (int m = 0; m < n; m++)
+        p[m] = rand () % 50 ? (uc)rand () : FRAMEDELIMITER;
+    return p;
+}
+
+// wire of NFRAMES frames of random length by L
+template <class L>
+std::vector<uc> wire_of ()
+{
+    typename L::frame fr;
+    std::vector<uc> w, p;
+    uc buf[L::maxwire];
+    for (int f = 0; f < NFRAMES; f++) {
+        p = payload (1 + rand () % L::maxmsg);
+        L::build_frame (fr, p.data (), p.size ());
+        w.insert (w.end (), buf, buf + L::stuff_frame (fr, buf));
+    }
+    return w;
+}
+
+// wire MB/s of decoding w ROUNDS times; frames counted by rx_done
+template <class L>
+double decode (L& line, const std::vector<uc>& w, bool bytewise)
+{
+    double t = now ();
+    for (int r = 0; r < ROUNDS; r++) {
+        if (bytewise)
+            for (uc c : w)
+                line.incoming_char (c);
+        else
+            line.incoming_chars (w.data (), w.size ());
+    }
+    return ROUNDS * w.size () / (now () - t) * 1e-6;
+}
+
+double decode_c (const std::vector<uc>& w, bool bytewise)
+{
+    t_line line;
+    init_line (&line, NULL, NULL, &callbacks);
+    double t = now ();
+    for (int r = 0; r < ROUNDS; r++) {
+        if (bytewise)
+            for (uc c : w)
+                incoming_char (&line, c);
+        else
+            incoming_chars (&line, (uc*)w.data (), w.size ());
+    }
+    return ROUNDS * w.size () / (now () - t) * 1e-6;
+}
+
+// wire MB/s of outgoing_char() over full frames
+double encode_c ()
+{
+    std::vector<uc> p = payload (MAXMSG);
+    t_line l, *line = &l;
+    long bytes = 0;
+    init_line (line, NULL, NULL, &callbacks);
+    double t = now ();
+    for (int r = 0; r < ROUNDS * 16; r++) {
+        build_frame (LWFR, p.data (), p.size ());
+        LWNEXT = SIGNATURE;
+        LWFLAGS |= READY;
+        while (LWNEXT <= LWLAST) {
+            sink = outgoing_char (line);
+            bytes++;
+        }
+        LWFLAGS &= ~(READY | HFDFL);
+    }
+    return bytes / (now () - t) * 1e-6;
+}
+
+template <class L>
+double encode ()
+{
+    std::vector<uc> p = payload (L::maxmsg);
+    L line;
+    long bytes = 0;
+    double t = now ();
+    for (int r = 0; r < ROUNDS * 16; r++) {
+        line.send (p.data (), p.size ());
+        while (line.wfr.flags & READY) {
+            sink = line.outgoing_char ();
+            bytes++;
+        }
+    }
+    return bytes / (now () - t) * 1e-6;
+}
+
+template <class L>
+int run (const char* name, const std::vector<uc>& w)
+{
+    L line;
+    double bytewise = decode (line, w, true);
+    double chars = decode (line, w, false);
+    msg ("%-26s %10.1f %10.1f %10.1f %8d %5d\n", name, bytewise, chars,
+            encode<L> (), line.cb.ok, line.cb.bad);
+    return line.cb.ok == 2 * ROUNDS * NFRAMES && !line.cb.bad;
+}
+
+int main ()
+{
+    std::vector<uc> w = wire_of<c_line<counter>> ();
+    c_line<counter>::frame fr;
+    t_frame cfr;
+    uc a[MAXWIRESIZE], b[MAXWIRESIZE];
+    double bytewise, chars;
+    int ok = 1, f;
+
+    // same frames on the wire as the C build makes
+    for (f = 0; f < NFRAMES; f++) {
+        std::vector<uc> p = payload (1 + rand () % MAXMSG);
+        build_frame (&cfr, p.data (), p.size ());
+        c_line<counter>::build_frame (fr, p.data (), p.size ());
+        if (stuff_frame (&cfr, a) != c_line<counter>::stuff_frame (fr, b)
+                || memcmp (a, b, stuff_frame (&cfr, a)))
+            ok = 0;
+    }
+    msg ("frames of %d bytes: C and C++ wire %s\n", MAXFRAMESIZE, ok ? "equal" : "DIFFER");
+
+    msg ("wire MB/s                  incoming_char  _chars   outgoing   frames   bad\n");
+    bytewise = decode_c (w, true);
+    chars = decode_c (w, false);
+    msg ("%-26s %10.1f %10.1f %10.1f %8d %5d\n", "C", bytewise, chars,
+            encode_c (), c_ok, c_bad);
+    ok &= c_ok == 2 * ROUNDS * NFRAMES && !c_bad;
+    ok &= run<c_line<counter>> ("c_line", w);
+    {
+        c_line<> line;
+        line.cb.cb_frame_rx_done = cxx_frame_rx_done;
+        bytewise = decode (line, w, true);
+        chars = decode (line, w, false);
+        msg ("%-26s %10.1f %10.1f %10.1f %8d %5d\n", "c_line, c_callbacks",
+                bytewise, chars, encode<c_line<>> (), p_ok, p_bad);
+        ok &= p_ok == 2 * ROUNDS * NFRAMES && !p_bad;
+    }
+    {
+        // the C callbacks above, on a t_line of the adapter
+        c_line<t_line_callbacks> line;
+        line.cb.attach (&callbacks);
+        c_ok = c_bad = 0;
+        bytewise = decode (line, w, true);
+        chars = decode (line, w, false);
+        msg ("%-26s %10.1f %10.1f %10.1f %8d %5d\n", "c_line, t_line_callbacks",
+                bytewise, chars, encode<c_line<t_line_callbacks>> (), c_ok, c_bad);
+        ok &= c_ok == 2 * ROUNDS * NFRAMES && !c_bad;
+    }
+    ok &= run<basic_line<255, uint8_t, checksum::crc16, counter>>
+            ("<255, uint8_t, crc16>",
+            wire_of<basic_line<255, uint8_t, checksum::crc16, counter>> ());
+    ok &= run<basic_line<1024, uint16_t, checksum::crc32c, counter>>
+            ("<1024, uint16_t, crc32c>",
+            wire_of<basic_line<1024, uint16_t, checksum::crc32c, counter>> ());
+    ok &= run<basic_line<4096, uint16_t, checksum::sum, counter>>
+            ("<4096, uint16_t, sum>",
+            wire_of<basic_line<4096, uint16_t, checksum::sum, counter>> ());
+    return !ok;
+}
@@ -0,0 +1,186 @@
+/*
+ * libtrivdl benchmark: two lines talking to each other over a pty pair,
+ * each served by async_machine() in a thread of its own, byte-at-a-time
+ * and TXFRAME, and both by one reactor. Regression gate for async machine
+ * performance.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+#include "libtrivdl.h"
+#include "reactor.h"
+#include "bench.h"
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#define FRAMES  20000   // per direction and frame size
+
+#define SELECT  0       // async_machine(), byte-at-a-time
+#define SELECTF 1       // async_machine(), TXFRAME
+#define EPOLL   2       // reactor, TXFRAME
+const char* modes[] = { "select", "select TXFRAME", "epoll TXFRAME" };
+
+typedef struct {
+    int tx, rx, bad;
+    int idle_rx;        // rx at previous cb_idle
+    int fsize;
+} t_userdata;
+
+#define UD      ((t_userdata*)(line->userdata))->
+
+// syscalls made by the library, counted by wrappers (see Makefile),
+// from both machine threads
+unsigned long nsyscalls;
+
+#define WRAP(ret, name, args, call) \
+    ret __real_##name args; \
+    ret __wrap_##name args { \
+        __atomic_fetch_add (&nsyscalls, 1, __ATOMIC_RELAXED); \
+        return __real_##name call; \
+    }
+
+WRAP(ssize_t, read, (int fd, void* buf, size_t n), (fd, buf, n))
+WRAP(ssize_t, write, (int fd, const void* buf, size_t n), (fd, buf, n))
+WRAP(int, tcdrain, (int fd), (fd))
+WRAP(int, select, (int n, fd_set* r, fd_set* w, fd_set* e, struct timeval* tv), (n, r, w, e, tv))
+WRAP(int, epoll_wait, (int epfd, struct epoll_event* ev, int max, int tmo), (epfd, ev, max, tmo))
+WRAP(int, epoll_ctl, (int epfd, int op, int fd, struct epoll_event* ev), (epfd, op, fd, ev))
+
+void send_data (t_line* line)
+{
+    uc pl[MAXFRAMESIZE];
+    int m;
+    pl[0] = 0x15;
+    for (m = 1; m < UD fsize - OVERHEAD; m++)
+        pl[m] = (uc)rand();
+    build_frame (LWFR, pl, UD fsize - OVERHEAD);
+    LWFLAGS |= READY;
+}
+
+void check_done (t_line* line)
+{
+    if (UD tx >= FRAMES && UD rx >= FRAMES)
+        LFLAGS |= EXIT_A_M;
+}
+
+void cb_frame_rx_done (uc status, t_line* line)
+{
+    UD rx++;
+    if (status != FROK)
+        UD bad++;
+    LRNEXT = 0;
+    LRFLAGS &= ~READY;
+    check_done (line);
+}
+
+void cb_frame_tx_done (uc status, t_line* line)
+{
+    if (++(UD tx) < FRAMES)
+        send_data (line);
+    check_done (line);
+}
+
+// nothing received for a whole period: frames were lost, give up
+float cb_idle (t_line* line)
+{
+    if (UD rx == UD idle_rx && UD tx >= FRAMES)
+        LFLAGS |= EXIT_A_M;
+    UD idle_rx = UD rx;
+    return 1.0;
+}
+
+t_callbacks callbacks = { cb_frame_rx_done, cb_frame_tx_done, cb_idle };
+
+double cpu_time ()
+{
+    struct rusage ru;
+    getrusage (RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6
+        + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+}
+
+void* machine (void* arg)
+{
+    async_machine (arg);
+    return NULL;
+}
+
+int run (int mode, int fsize)
+{
+    t_reactor r;
+    t_line line[2];
+    t_userdata ud[2];
+    pthread_t th;
+    int fd[2], k, frames, lost, bad;
+    double t, cpu;
+    unsigned long sc;
+
+    if (open_pair (fd, fd + 1))
+        return -1;
+    if (mode == EPOLL && !init_reactor (&r))
+        return -1;
+    for (k = 0; k < 2; k++) {
+        fcntl (fd[k], F_SETFL, fcntl (fd[k], F_GETFL) | O_NONBLOCK);
+        init_line (line + k, NULL, ud + k, &callbacks);
+        line[k].fd = fd[k];
+        line[k].lflags = mode == SELECT ? 0 : TXFRAME;
+        ud[k].tx = ud[k].rx = ud[k].bad = ud[k].idle_rx = 0;
+        ud[k].fsize = fsize;
+        send_data (line + k);
+        if (mode == EPOLL)
+            reactor_add_line (&r, line + k);
+    }
+
+    sc = nsyscalls;
+    cpu = cpu_time ();
+    t = now ();
+    if (mode == EPOLL) {
+        reactor_run (&r);
+    } else {
+        pthread_create (&th, NULL, machine, line);
+        async_machine (line + 1);
+        pthread_join (th, NULL);
+    }
+    t = now () - t;
+    cpu = cpu_time () - cpu;
+    sc = nsyscalls - sc;
+
+    if (mode == EPOLL)
+        close_reactor (&r);
+    close (fd[0]);
+    close (fd[1]);
+    frames = ud[0].rx + ud[1].rx;
+    lost = 2 * FRAMES - frames;
+    bad = ud[0].bad + ud[1].bad;
+    msg ("%6d %-14s %10.0f %12.0f %10.2f %10.2f %6d %6d\n", fsize, modes[mode],
+            frames / t, frames * (double)(fsize - OVERHEAD) / t,
+            cpu * 1e6 / frames, (double)sc / frames, lost, bad);
+#ifdef LATENCY
+    lat_dump (stdout, "  queue", &line[0].lat.queue);
+    lat_dump (stdout, "  tx", &line[0].lat.tx);
+    lat_dump (stdout, "  rx", &line[1].lat.rx);
+#endif
+    return lost + bad;
+}
+
+int main ()
+{
+    int fsize, mode, fail = 0;
+
+    msg ("%d frames each way per size, two lines: async_machine() each, or one reactor\n",
+            FRAMES);
+    msg (" frame machine          frames/s  payload B/s  CPU us/fr  sysc./fr   lost    bad\n");
+    for (fsize = MINFRAMESIZE; ; fsize *= 2) {
+        if (fsize > MAXFRAMESIZE)
+            fsize = MAXFRAMESIZE;
+        for (mode = SELECT; mode <= EPOLL; mode++)
+            if (run (mode, fsize))
+                fail = 1;
+        if (fsize == MAXFRAMESIZE)
+            break;
+    }
+    return fail;
+}
@@ -0,0 +1,170 @@
+/*
+ * libtrivdl benchmark: frame pool against malloc(), by threads, with
+ * frames freed by the thread which took them and by another one.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+#include "libtrivdl.h"
+#include "pool.h"
+#include "bench.h"
+#include <stdlib.h>
+#include <sched.h>
+
+#define OPS     2000000 // alloc and free pairs per thread
+#define HELD    64      // frames a thread holds at once, e.g. its queues
+#define MAXTHR  8
+#define RING    256     // handoff: frames in flight from producer to consumer
+
+t_pool pool;
+bool use_pool;
+
+static inline t_frame* get ()
+{
+    if (use_pool)
+        return pool_alloc (&pool);
+    return malloc (sizeof(t_frame));
+}
+
+static inline void put (t_frame* fr)
+{
+    if (use_pool)
+        pool_free (&pool, fr);
+    else
+        free (fr);
+}
+
+// thread takes HELD frames, then frees the oldest and takes a new one
+void* local (void* arg)
+{
+    t_frame* held[HELD];
+    int i;
+    long* fails = arg;
+
+    for (i = 0; i < OPS + HELD; i++) {
+        if (i >= HELD)
+            put (held[i % HELD]);
+        if (i < OPS) {
+            held[i % HELD] = get ();
+            if (!held[i % HELD])
+                (*fails)++;
+            else
+                held[i % HELD]->data[0] = (uc)i; // touch it
+        }
+    }
+    return NULL;
+}
+
+// producer takes frames, consumer frees them
+typedef struct {
+    t_frame* ring[RING];
+    volatile unsigned long head, tail;
+    long fails;
+} t_handoff;
+
+void* producer (void* arg)
+{
+    t_handoff* h = arg;
+    t_frame* fr;
+    unsigned long n = 0;
+
+    while (n < OPS) {
+        if (n - __atomic_load_n (&h->head, __ATOMIC_ACQUIRE) == RING) {
+            sched_yield ();
+            continue;
+        }
+        fr = get ();
+        if (!fr) {
+            h->fails++;
+            continue;
+        }
+        fr->data[0] = (uc)n;
+        h->ring[n % RING] = fr;
+        __atomic_store_n (&h->tail, ++n, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+void* consumer (void* arg)
+{
+    t_handoff* h = arg;
+    unsigned long n = 0;
+
+    while (n < OPS) {
+        if (n == __atomic_load_n (&h->tail, __ATOMIC_ACQUIRE)) {
+            sched_yield ();
+            continue;
+        }
+        put (h->ring[n % RING]);
+        __atomic_store_n (&h->head, ++n, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// ns per alloc and free pair, over all threads
+double run (int nthr, bool handoff, long* fails)
+{
+    pthread_t th[MAXTHR];
+    t_handoff h[MAXTHR / 2];
+    long f[MAXTHR];
+    double t;
+    int i;
+
+    memset (f, 0, sizeof(f));
+    memset (h, 0, sizeof(h));
+    t = now ();
+    for (i = 0; i < nthr; i++) {
+        if (handoff)
+            pthread_create (th + i, NULL, i & 1 ? consumer : producer, h + i / 2);
+        else
+            pthread_create (th + i, NULL, local, f + i);
+    }
+    for (i = 0; i < nthr; i++)
+        pthread_join (th[i], NULL);
+    t = now () - t;
+    *fails = 0;
+    for (i = 0; i < nthr; i++)
+        *fails += handoff ? h[i / 2].fails * !(i & 1) : f[i];
+    return t * 1e9 / ((double)OPS * (handoff ? nthr / 2 : nthr));
+}
+
+int main ()
+{
+    static const int thr[] = { 1, 2, 4, 8 };
+    t_pool_stats st;
+    unsigned long refills;
+    long fails;
+    int i, h, fail = 0;
+    double ns[2];
+
+    // a thread holds HELD, and up to 2 * POOL_BATCH on its free lists
+    if (!init_pool (&pool, sizeof(t_frame), MAXTHR * (HELD + RING + 2 * POOL_BATCH)))
+        return 2;
+    pool_stats (&pool, &st, false);
+    msg ("%zu frames of %zu bytes (t_frame is %zu), %d alloc+free per thread\n",
+            st.blocks, st.size, sizeof(t_frame), OPS);
+    msg ("                  threads   malloc ns   pool ns    high   refills  fails\n");
+    for (h = 0; h < 2; h++) {
+        for (i = 0; i < 4; i++) {
+            if (h && thr[i] < 2)
+                continue;
+            use_pool = false;
+            ns[0] = run (thr[i], h, &fails);
+            use_pool = true;
+            pool_stats (&pool, &st, true);
+            refills = st.refills;
+            ns[1] = run (thr[i], h, &fails);
+            pool_stats (&pool, &st, false);
+            msg ("%-18s %6d %11.1f %9.1f %7zu %9lu %6ld\n",
+                    h ? "handoff" : "alloc+free local", thr[i], ns[0], ns[1],
+                    st.high, st.refills - refills, fails);
+            // threads are gone, all their frames must be back
+            if (fails || st.out)
+                fail = 1;
+        }
+    }
+    close_pool (&pool);
+    return fail;
+}
@@ -0,0 +1,166 @@
+/*
+ * libtrivdl benchmark: decode throughput of a wire capture, replayed
+ * through incoming_char() and incoming_chars().
+ * Without arguments, it first captures traffic of two TXFRAME lines
+ * on one reactor to a temporary file in /tmp, removed once loaded.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+#include "libtrivdl.h"
+#include "reactor.h"
+#include "tap.h"
+#include "bench.h"
+#include <stdlib.h>
+
+#define FRAMES  20000   // captured each way
+#define ROUNDS  20      // replays of the capture per mode
+
+typedef struct {
+    int tx, rx, bad;
+    int idle_rx;
+} t_userdata;
+
+#define UD      ((t_userdata*)(line->userdata))->
+
+void send_data (t_line* line)
+{
+    uc* pl = frame_payload (LWFR);
+    int m, n = 1 + rand () % MAXMSG;
+    pl[0] = 0x15;
+    for (m = 1; m < n; m++)
+        pl[m] = (uc)rand();
+    finalize_frame (LWFR, n);
+    LWFLAGS |= READY;
+}
+
+void check_done (t_line* line)
+{
+    if (UD tx >= FRAMES && UD rx >= FRAMES)
+        LFLAGS |= EXIT_A_M;
+}
+
+void cb_frame_rx_done (uc status, t_line* line)
+{
+    UD rx++;
+    if (status != FROK)
+        UD bad++;
+    LRNEXT = 0;
+    LRFLAGS &= ~READY;
+    check_done (line);
+}
+
+void cb_frame_tx_done (uc status, t_line* line)
+{
+    if (++(UD tx) < FRAMES)
+        send_data (line);
+    check_done (line);
+}
+
+// nothing received for a whole period: frames were lost, give up
+float cb_idle (t_line* line)
+{
+    if (UD rx == UD idle_rx && UD tx >= FRAMES)
+        LFLAGS |= EXIT_A_M;
+    UD idle_rx = UD rx;
+    return 1.0;
+}
+
+t_callbacks callbacks = { cb_frame_rx_done, cb_frame_tx_done, cb_idle };
+
+// exchange between two lines, the first one tapped. returns its fd
+int capture (const char* path)
+{
+    t_reactor r;
+    t_tap tap;
+    t_line line[2];
+    t_userdata ud[2];
+    int fd[2], k;
+
+    if (open_pair (fd, fd + 1) || !init_reactor (&r) || !init_tap (&tap, path))
+        exit (2);
+    for (k = 0; k < 2; k++) {
+        fcntl (fd[k], F_SETFL, fcntl (fd[k], F_GETFL) | O_NONBLOCK);
+        init_line (line + k, NULL, ud + k, &callbacks);
+        line[k].fd = fd[k];
+        line[k].lflags = TXFRAME;
+        memset (ud + k, 0, sizeof(t_userdata));
+        send_data (line + k);
+        reactor_add_line (&r, line + k);
+    }
+    line[0].tap = &tap;
+    reactor_run (&r);
+    line[0].tap = NULL;
+    close_tap (&tap);
+    close_reactor (&r);
+    close (fd[1]);
+    msg ("captured %lu records (%lu dropped) to %s, line %d received %d frames\n",
+            tap.records, tap.dropped, path, fd[0], ud[0].rx);
+    close (fd[0]);
+    return fd[0];
+}
+
+// decoded frames per second; frames and bad frames of one replay
+double replay (uc* buf, size_t size, int id, bool bytewise,
+        int* frames, int* bad, long* bytes)
+{
+    t_line line;
+    t_userdata ud;
+    double t;
+    int k;
+
+    init_line (&line, NULL, &ud, &callbacks);
+    t = now ();
+    for (k = 0; k < ROUNDS; k++) {
+        memset (&ud, 0, sizeof(ud));
+        init_frame (&line.rfr);
+        *bytes = capture_replay (&line, buf, size, id, TAP_RX, bytewise);
+    }
+    t = now () - t;
+    *frames = ud.rx;
+    *bad = ud.bad;
+    return ROUNDS * ud.rx / t;
+}
+
+int main (int argc, char** argv)
+{
+    char tmp[] = "/tmp/trivdl-replay-XXXXXX";
+    const char* path = argc > 1 ? argv[1] : tmp;
+    int id = argc > 2 ? atoi (argv[2]) : -1;
+    int frames[2], bad[2], mode, fd;
+    double fps;
+    long bytes;
+    size_t size;
+    uc* buf;
+
+    if (argc < 2) {
+        fd = mkstemp (tmp);
+        if (fd < 0) {
+            err("mkstemp: %s\n", strerror(errno));
+            return 2;
+        }
+        close (fd);
+        id = capture (path);
+    }
+    buf = capture_load (path, &size);
+    if (argc < 2)
+        unlink (tmp);
+    if (!buf)
+        return 2;
+    msg ("RX of line %d replayed %d times\n", id, ROUNDS);
+    msg ("            frames/s     wire MB/s   frames      bad\n");
+    for (mode = 0; mode < 2; mode++) {
+        fps = replay (buf, size, id, !mode, frames + mode, bad + mode, &bytes);
+        msg ("%-14s %9.0f %12.1f %8d %8d\n",
+                mode ? "incoming_chars" : "incoming_char",
+                fps, fps / frames[mode] * bytes * 1e-6, frames[mode], bad[mode]);
+    }
+    free (buf);
+    // both decoders must agree, and a fresh capture must be clean
+    if (frames[0] != frames[1] || bad[0] != bad[1]
+            || (argc < 2 && (frames[1] != FRAMES || bad[1])))
+        return 1;
+    return 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * libtrivdl benchmark: byte stuffing, outgoing_char() vs stuff_frame().
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+#include "libtrivdl.h"
+#include "bench.h"
+#include <stdlib.h>
+
+#define NFRAMES     1024
+#define ROUNDS      2000
+
+t_frame frames[NFRAMES];
+volatile uc sink;
+
+// full-size frames, 0xBA at given share of payload bytes
+void fill (int permille)
+{
+    uc pl[MAXFRAMESIZE];
+    int f, m;
+    for (f = 0; f < NFRAMES; f++) {
+        pl[0] = 0x15;
+        for (m = 1; m < MAXFRAMESIZE - OVERHEAD; m++) {
+            if (rand() % 1000 < permille)
+                pl[m] = FRAMEDELIMITER;
+            else
+                do pl[m] = (uc)rand(); while (pl[m] == FRAMEDELIMITER);
+        }
+        build_frame (frames + f, pl, MAXFRAMESIZE - OVERHEAD);
+    }
+}
+
+// payload bytes per ns
+double by_char (t_line* line)
+{
+    int r, f;
+    double t = now ();
+    for (r = 0; r < ROUNDS; r++)
+        for (f = 0; f < NFRAMES; f++) {
+            line->wfr = frames[f];
+            while (LWNEXT <= LWLAST)
+                sink = outgoing_char (line);
+        }
+    return (double)ROUNDS * NFRAMES * MAXFRAMESIZE / ((now () - t) * 1e9);
+}
+
+double by_frame ()
+{
+    uc wire[MAXWIRESIZE];
+    int r, f;
+    double t = now ();
+    for (r = 0; r < ROUNDS; r++)
+        for (f = 0; f < NFRAMES; f++)
+            sink = wire[stuff_frame (frames + f, wire) - 1];
+    return (double)ROUNDS * NFRAMES * MAXFRAMESIZE / ((now () - t) * 1e9);
+}
+
+int main ()
+{
+    t_line line;
+    int density[] = {0, 10, 100};
+    int d;
+
+    init_line (&line, NULL, NULL, NULL); // no callbacks needed
+    msg ("%d-byte frames, bytes/ns\n", MAXFRAMESIZE);
+    msg ("  0xBA   outgoing_char  stuff_frame\n");
+    for (d = 0; d < 3; d++) {
+        fill (density[d]);
+        msg ("%5.1f%% %15.3f %12.3f\n", density[d] / 10.0,
+                by_char (&line), by_frame ());
+    }
+    return 0;
+}
@@ -0,0 +1,102 @@
+/*
+ * libtrivdl benchmark: transmit byte-at-a-time vs whole frame (TXFRAME).
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+#include "libtrivdl.h"
+#include "bench.h"
+#include <stdlib.h>
+#include <pthread.h>
+
+#define FRAMES  2000
+
+typedef struct {
+    int frames;
+    uc fsize;
+} t_userdata;
+
+#define UD      ((t_userdata*)(line->userdata))->
+
+void send_data (t_line* line)
+{
+    uc pl[MAXFRAMESIZE];
+    uc m;
+    pl[0] = 0x15;
+    for (m = 1; m < UD fsize - OVERHEAD; m++)
+        pl[m] = (uc)rand();
+    build_frame (LWFR, pl, UD fsize - OVERHEAD);
+    LWFLAGS |= READY;
+}
+
+void cb_frame_rx_done (uc status, t_line* line)
+{
+    LRNEXT = 0;
+    LRFLAGS &= ~READY;
+}
+
+void cb_frame_tx_done (uc status, t_line* line)
+{
+    if (++(UD frames) >= FRAMES)
+        LFLAGS |= EXIT_A_M;
+    else
+        send_data (line);
+}
+
+float cb_idle (t_line* line)
+{
+    return 0.1;
+}
+
+t_callbacks callbacks = { cb_frame_rx_done, cb_frame_tx_done, cb_idle };
+
+// peer side: swallow everything
+void* sink (void* arg)
+{
+    int fd = *(int*)arg;
+    uc buf[4096];
+    while (read (fd, buf, sizeof(buf)) > 0)
+        ;
+    return NULL;
+}
+
+double run (int fd, uc lflags, uc fsize)
+{
+    t_line line;
+    t_userdata ud;
+    double t;
+
+    init_line (&line, NULL, &ud, &callbacks);
+    line.fd = fd;
+    line.lflags = lflags;
+    ud.frames = 0;
+    ud.fsize = fsize;
+    t = now ();
+    send_data (&line);
+    async_machine (&line);
+    return now () - t;
+}
+
+int main ()
+{
+    int a, b;
+    pthread_t th;
+    uc fsize;
+    double t1, t2, t3;
+
+    if (open_pair (&a, &b))
+        return 1;
+    pthread_create (&th, NULL, sink, &a);
+    msg ("%d frames per run\n", FRAMES);
+    msg ("   frame   byte fr/s  TXFRAME fr/s  +TXDRAIN fr/s\n");
+    for (fsize = MINFRAMESIZE; fsize <= MAXFRAMESIZE; fsize *= 2) {
+        t1 = run (b, 0, fsize);
+        t2 = run (b, TXFRAME, fsize);
+        t3 = run (b, TXFRAME | TXDRAIN, fsize);
+        msg ("%8hhu %12.0f %13.0f %14.0f\n", fsize,
+                FRAMES / t1, FRAMES / t2, FRAMES / t3);
+    }
+    return 0;
+}
@@ -56,7 +56,7 @@ void cb_frame_rx_done (uc status)
         // this invalidates RX frame checksum, which we don't care
         LRMSG = OP_ECHOREP;
         // copy RX frame content to TX frame
-        build_frame (LWFR, &(LRMSG), LRLAST-2);
+        build_frame (LWFR, &(LRMSG), LRMSGLEN);
         // initiate transmission
         UCA0TXBUF = outgoing_char(); // generally LWDATA[LWNEXT++]
         UC0IE |= UCA0TXIE; // Enable USCI_A0 TX interrupt
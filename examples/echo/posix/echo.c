@@ -8,17 +8,21 @@
 
 #include "serial.h"
 #include "libtrivdl.h"
+#include "timer.h"
 
 typedef struct {
     char sent;
+    t_timer reply;  // runs out if there is no reply, however busy the line is
 } t_userdata;
 
 #define SENT    ((t_userdata*)(line->userdata))->sent
+#define REPLY   ((t_userdata*)(line->userdata))->reply
 
 void cb_frame_rx_done (uc status, t_line* line)
 {
     msg ("frame received (%s, msg 0x%hhx)\n", 
             strfrret(status), LRMSG);
+    timer_stop (&REPLY);
     LFLAGS |= EXIT_A_M; // stop async machine
 }
 
@@ -28,28 +32,39 @@ void cb_frame_tx_done (uc status, t_line* line)
             strfrret(status), LWMSG);
 }
 
+void cb_no_reply (t_timer* t)
+{
+    t_line* line = t->userdata;
+    err ("no reply within timeout\n");
+    LFLAGS |= EXIT_A_M; // stop async machine
+}
+
 float cb_idle (t_line* line)
 {
-    if (SENT) {
-        err ("no reply within timeout\n");
-        LFLAGS |= EXIT_A_M; // stop async machine
-    } else {
+    if (!SENT) {
         build_frame (LWFR, "\x10payload", 8); // \x10=ping
         //wrn("sending: %s\n", strfr(LWFR));
         LWFLAGS |= READY; // async machine starts transmitting
         SENT = 1;
+        timer_start (line->timers, &REPLY, 0.5, 0);
     }
-    return 0.5;  // recall in 0.5 sec if there is no I/O
+    return 10;  // nothing else to do when there is no I/O
 }
 
+t_callbacks callbacks = { cb_frame_rx_done, cb_frame_tx_done, cb_idle };
+
 int main()
 {
     t_line line;
     t_userdata userdata;
+    t_wheel timers;
 
-    init_line (&line, "/dev/ttyUSB0", &userdata);
+    init_line (&line, "/dev/ttyUSB0", &userdata, &callbacks);
     set_interface_attribs (line.fd, B9600); // 9600 bps 8N1
     userdata.sent = 0;
+    init_wheel (&timers);
+    init_timer (&userdata.reply, cb_no_reply, &line);
+    line.timers = &timers;
     return async_machine (&line);
 }
 
@@ -16,12 +16,12 @@
 
 void create_and_send_data (t_line* line)
 {
-    uc pl[MAXFRAMESIZE]; // payload
+    uc* pl = frame_payload (LWFR); // payload, built in place
     uc m;
     pl[0] = 0x10; // OP_ECHORQ
     for (m = 1; m < FSIZE-OVERHEAD; m++)
         pl[m] = (uc)rand();
-    build_frame (LWFR, pl, FSIZE-OVERHEAD);
+    finalize_frame (LWFR, FSIZE-OVERHEAD);
     //wrn("built: %s\n", strfr(LWFR));
     LWNEXT = 0;
     LWFLAGS |= READY; // async machine starts transmitting
@@ -29,10 +29,9 @@ void create_and_send_data (t_line* line)
 
 void request_remote_stream (t_line* line)
 {
-    uc sf[2]; // start frame
-    sf[0] = OP_STREAM_START;
-    sf[1] = FSIZE;
-    build_frame (LWFR, sf, 2);
+    uc op = OP_STREAM_START;
+    t_iovec sf[2] = { { &op, 1 }, { &FSIZE, 1 } }; // start frame
+    build_framev (LWFR, sf, 2);
     //wrn("built: %s\n", strfr(LWFR));
     LWNEXT = 0;
     LWFLAGS |= READY; // async machine starts transmitting
@@ -118,12 +117,16 @@ float cb_idle (t_line* line)
     return 0.0;
 }
 
+t_callbacks callbacks = { cb_frame_rx_done, cb_frame_tx_done, cb_idle };
+
 t_baud data_session (t_line* line, int maxchars, uc framesize)
 {
     long int tstart, tstop, tdel;
     float rc, tc, rrc, rtc;
     t_baud res;
+    t_stats st;
 
+    line_stats (line, &st, true); // count this session only
     time (&tstart);
     memset (line->userdata, 0, sizeof(t_userdata));
     FSIZE = framesize;
@@ -152,6 +155,12 @@ t_baud data_session (t_line* line, int maxchars, uc framesize)
     msg ("remote reported DATA:\nrx: total %hu, errors %hu (useful %.1f cps, %d baud)\ntx: total %hu, errors %hu (useful %.1f cps, %d baud)\n", 
             PRX, PRXERR, rrc, res.rbrc,
             PTX, PTXERR, rtc, res.rbtc);
+    line_stats (line, &st, false);
+    msg ("link: rx %lu bytes, %lu ok, %lu bad format, %lu bad sum, %lu too long, %lu garbage\n"
+            "      tx %lu bytes, %lu frames, %lu stuffed\n",
+            st.rx_bytes, st.rx_frames[FROK], st.rx_frames[FRBADFMT],
+            st.rx_frames[FRBADSUM], st.rx_frames[FRTOOLONG], st.rx_garbage,
+            st.tx_bytes, st.tx_frames, st.tx_stuffed);
     return res;
 }
 
@@ -166,7 +175,7 @@ int main()
     int sess;
     uc fsize;
 
-    init_line (&line, "/dev/ttyUSB0", &ud);
+    init_line (&line, "/dev/ttyUSB0", &ud, &callbacks);
     set_interface_attribs (line.fd, B9600); // 9600 bps 8N1
 
     for (sess = 0; sess < PROBES; sess++) {
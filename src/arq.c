@@ -0,0 +1,285 @@
+/*
+ * libtrivdl ARQ implementation.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+// ARQ needs per-line callbacks, arq.h refuses STATIC_CALLBACKS
+#ifndef STATIC_CALLBACKS
+
+#include "arq.h"
+// offsetof
+#include <stddef.h>
+#include <time.h>
+
+#define SLOT(s)     ((s) & (ARQ_MAXWIN - 1))
+
+
+static double mono ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static void arq_rx_done (uc status, t_line* line);
+static void arq_tx_done (uc status, t_line* line);
+static float arq_idle (t_line* line);
+static const t_callbacks arq_callbacks = { arq_rx_done, arq_tx_done, arq_idle };
+static void arq_pump (t_arq* a);
+
+
+// retransmission timer of a slot
+static void arq_rto (t_timer* t)
+{
+    t_arq* a = t->userdata;
+    t_arq_slot* sl = (t_arq_slot*)((char*)t - offsetof(t_arq_slot, timer));
+
+    if (sl->state == ARQ_SENT) {
+        sl->state = ARQ_QUEUED;
+        a->timeouts++;
+        arq_pump (a);
+    }
+}
+
+
+int init_arq (t_arq* a, t_line* line, int window, float rto,
+        const t_arq_callbacks* cb, void* userdata)
+{
+    int i;
+
+    if (window < 1 || window > ARQ_MAXWIN) {
+        err("arq: window %d is out of 1..%d\n", window, ARQ_MAXWIN);
+        return 0;
+    }
+    memset (a, 0, sizeof(*a));
+    a->line = line;
+    a->cb = cb;
+    a->userdata = userdata;
+    a->window = window;
+    a->rto = rto;
+    for (i = 0; i < ARQ_MAXWIN; i++)
+        init_timer (&a->tx[i].timer, arq_rto, a);
+    line->cb = &arq_callbacks;
+    line->userdata = a;
+    return 1;
+}
+
+
+int arq_inflight (t_arq* a)
+{
+    return (uc)(a->next - a->base);
+}
+
+
+// send n bytes at LWMSG
+static void arq_tx (t_line* line, int n)
+{
+    finalize_frame (LWFR, n);
+    LWNEXT = SIGNATURE;
+    LWFLAGS |= READY;
+}
+
+
+// choose next frame when tx is free: nak, or ack with sack if we hold
+// frames out of order, else the oldest data to (re)send, else plain ack
+static void arq_pump (t_arq* a)
+{
+    t_line* line = a->line;
+    uc* m = &LWMSG;
+    t_arq_slot* sl = NULL;
+    uint32_t sack;
+    double now;
+    uc s;
+    int i;
+
+    if (LWFLAGS & READY)
+        return;
+    if (!a->sack_due && !a->nak_due) {
+        now = mono ();
+        for (s = a->base; s != a->next; s++) {
+            sl = a->tx + SLOT(s);
+            if (!line->timers && sl->state == ARQ_SENT
+                    && now - sl->sent_at >= a->rto) {
+                sl->state = ARQ_QUEUED;
+                a->timeouts++;
+            }
+            if (sl->state == ARQ_QUEUED)
+                break;
+        }
+        if (s != a->next) {
+            m[0] = ARQ_DATA;
+            m[1] = s;
+            m[2] = a->expect; // piggybacked ack
+            memcpy (m + ARQ_HDR, sl->data, sl->len);
+            if (sl->sends++)
+                a->resent++;
+            else
+                a->sent++;
+            sl->state = ARQ_SENT;
+            sl->sent_at = now;
+            sl->order = ++a->order;
+            if (line->timers)
+                timer_start (line->timers, &sl->timer, a->rto, 0);
+            a->ack_due = false;
+            arq_tx (line, ARQ_HDR + sl->len);
+            return;
+        }
+    }
+    if (a->ack_due || a->sack_due || a->nak_due) {
+        sack = 0;
+        for (i = 0; i < ARQ_MAXWIN - 1; i++)
+            if (a->rx[SLOT(a->expect + 1 + i)].state == ARQ_QUEUED)
+                sack |= 1UL << i;
+        m[0] = a->nak_due ? ARQ_NAK : ARQ_ACK;
+        m[1] = a->expect;
+        for (i = 0; i < 4; i++)
+            m[2 + i] = sack >> (8 * i);
+        a->ack_due = a->sack_due = a->nak_due = false;
+        arq_tx (line, ARQ_ACKSIZE);
+    }
+}
+
+
+// peer expects ack next and holds frames marked in sack
+static void arq_acked (t_arq* a, uc ack, uint32_t sack)
+{
+    uc n = ack - a->base;
+    uc inflight = a->next - a->base;
+    unsigned last = 0;
+    t_arq_slot* sl;
+    uc s;
+    int i;
+
+    if (n > inflight)
+        return; // stale
+    for (s = a->base; s != ack; s++) {
+        a->tx[SLOT(s)].state = ARQ_FREE;
+        timer_stop (&a->tx[SLOT(s)].timer);
+    }
+    a->base = ack;
+    for (i = 0; i < 32 && (uc)(i + 1) < (uc)(inflight - n); i++) {
+        if (!(sack & (1UL << i)))
+            continue;
+        sl = a->tx + SLOT(ack + 1 + i);
+        sl->state = ARQ_SACKED;
+        if (sl->order > last)
+            last = sl->order;
+    }
+    // holes sent before a frame that got through are lost: resend now
+    for (s = ack; s != a->next; s++) {
+        sl = a->tx + SLOT(s);
+        if (sl->state == ARQ_SENT && sl->order < last)
+            sl->state = ARQ_QUEUED;
+    }
+    if (n && a->cb->cb_msg_acked)
+        a->cb->cb_msg_acked (a, n);
+}
+
+
+static void arq_deliver (t_arq* a, uc* msg, int len)
+{
+    a->delivered++;
+    a->cb->cb_msg_rx (a, msg, len);
+}
+
+
+static void arq_data (t_arq* a, uc s, uc* p, int n)
+{
+    uc d = s - a->expect;
+    t_arq_slot* sl;
+    int i;
+
+    if (d >= ARQ_MAXWIN) {
+        // delivered already, our ack was lost
+        a->dups++;
+    } else if (d) {
+        // out of order, hold it
+        sl = a->rx + SLOT(s);
+        if (sl->state == ARQ_QUEUED) {
+            a->dups++;
+        } else {
+            memcpy (sl->data, p, n);
+            sl->len = n;
+            sl->state = ARQ_QUEUED;
+        }
+    } else {
+        a->expect++;
+        arq_deliver (a, p, n);
+        while ((sl = a->rx + SLOT(a->expect))->state == ARQ_QUEUED) {
+            sl->state = ARQ_FREE;
+            a->expect++;
+            arq_deliver (a, sl->data, sl->len);
+        }
+    }
+    a->ack_due = true;
+    for (i = 1; i < ARQ_MAXWIN; i++)
+        if (a->rx[SLOT(a->expect + i)].state == ARQ_QUEUED)
+            a->sack_due = true;
+}
+
+
+static void arq_rx_done (uc status, t_line* line)
+{
+    t_arq* a = line->userdata;
+    uc* m = &LRMSG;
+    int n = LRMSGLEN;
+
+    t_arq_slot* sl;
+
+    if (status != FROK) {
+        a->nak_due = true;
+    } else if (m[0] == ARQ_DATA && n >= ARQ_HDR) {
+        arq_acked (a, m[2], 0);
+        arq_data (a, m[1], m + ARQ_HDR, n - ARQ_HDR);
+    } else if ((m[0] == ARQ_ACK || m[0] == ARQ_NAK) && n >= ARQ_ACKSIZE) {
+        arq_acked (a, m[1], m[2] | m[3] << 8 | m[4] << 16 | (uint32_t)m[5] << 24);
+        if (m[0] == ARQ_NAK) {
+            a->naks++;
+            sl = a->tx + SLOT(a->base);
+            if (a->base != a->next && sl->state == ARQ_SENT)
+                sl->state = ARQ_QUEUED;
+            a->ack_due = true;
+        }
+    }
+    LRFLAGS &= ~READY;
+    arq_pump (a);
+}
+
+
+static void arq_tx_done (uc status, t_line* line)
+{
+    (void)status;
+    arq_pump (line->userdata);
+}
+
+
+// timeouts are checked on every frame, and here if the line is quiet.
+// with timers, they come on their own
+static float arq_idle (t_line* line)
+{
+    t_arq* a = line->userdata;
+    arq_pump (a);
+    return line->timers ? 1.0 : a->rto / 4;
+}
+
+
+int arq_send (t_arq* a, uc* msg, int len)
+{
+    t_arq_slot* sl;
+    if (len > ARQ_MAXMSG || arq_inflight (a) >= a->window)
+        return 0;
+    sl = a->tx + SLOT(a->next);
+    a->next++;
+    memcpy (sl->data, msg, len);
+    sl->len = len;
+    sl->sends = 0;
+    sl->state = ARQ_QUEUED;
+    arq_pump (a);
+    return 1;
+}
+
+#endif
@@ -0,0 +1,111 @@
+/*
+ * libtrivdl ARQ: reliable in-order delivery over a line (selective repeat),
+ * POSIX only.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+#ifndef ARQ_H
+#define ARQ_H
+
+#include "libtrivdl.h"
+#include "timer.h"
+
+#ifdef STATIC_CALLBACKS
+#error "arq.h needs per-line callbacks, build without STATIC_CALLBACKS"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// ARQ takes the line over: it installs its own callbacks and userdata,
+// and the message of each frame starts with ARQ header:
+//   DATA: ARQ_DATA  seq  ack  payload...
+//   ACK:  ARQ_ACK   ack  sack (4 bytes, little endian)
+//   NAK:  ARQ_NAK   ack  sack
+// ack is the next seq expected in order (cumulative acknowledgment),
+// bit i of sack means ack+1+i is received too, so that sender resends
+// the holes at once (selective reject) rather than on timeout.
+// NAK is ACK sent on a damaged frame: peer resends its oldest frame
+// or, if it has none, acks.
+#define ARQ_DATA    0x01
+#define ARQ_ACK     0x02
+#define ARQ_NAK     0x03
+#define ARQ_HDR     3       // DATA header size
+#define ARQ_ACKSIZE 6       // ACK message size
+#define ARQ_MAXMSG  (MAXFRAMESIZE - OVERHEAD - ARQ_HDR)
+
+// window limit: power of two, up to 32 (sack width).
+// receiver accepts any frame within ARQ_MAXWIN, so window
+// may differ at both ends
+#ifndef ARQ_MAXWIN
+#define ARQ_MAXWIN  32
+#endif
+#if ARQ_MAXWIN > 32 || (ARQ_MAXWIN & (ARQ_MAXWIN - 1))
+#error "ARQ_MAXWIN must be a power of two up to 32"
+#endif
+
+// slot state
+#define ARQ_FREE    0
+#define ARQ_QUEUED  1   // tx: to be (re)sent; rx: received out of order
+#define ARQ_SENT    2   // tx: waiting for ack
+#define ARQ_SACKED  3   // tx: receiver has it, waiting for cumulative ack
+
+typedef struct {
+    uc data[ARQ_MAXMSG];
+    t_size len;
+    uc state;
+    uc sends;           // tx: transmissions
+    unsigned order;     // tx: transmission number, see t_arq.order
+    double sent_at;     // tx: time of last transmission
+    t_timer timer;      // tx: retransmission, if line has timers
+} t_arq_slot;
+
+struct s_arq;
+typedef struct {
+    // message delivered in order, exactly once. msg is valid during the call
+    void (*cb_msg_rx) (struct s_arq* a, uc* msg, int len);
+    // n oldest messages are acknowledged, so arq_send() has room
+    void (*cb_msg_acked) (struct s_arq* a, int n);
+} t_arq_callbacks;
+
+typedef struct s_arq {
+    t_line* line;
+    const t_arq_callbacks* cb;
+    void* userdata;
+    int window;         // max messages in flight
+    float rto;          // retransmission timeout, s
+    // tx: seq base..next-1 are in flight
+    uc base, next;
+    unsigned order;     // transmissions so far
+    t_arq_slot tx[ARQ_MAXWIN];
+    // rx
+    uc expect;          // next seq to deliver
+    bool ack_due;       // data received since last ack sent
+    bool sack_due;      // out of order data held: ack with sack first
+    bool nak_due;       // damaged frame received
+    t_arq_slot rx[ARQ_MAXWIN];
+    // counters
+    unsigned long sent, resent, timeouts, naks, delivered, dups;
+} t_arq;
+
+// attach ARQ to initialized line (fd set, not running).
+// window from 1 (stop-and-wait) to ARQ_MAXWIN. returns 1 on success.
+// if line->timers is set, each frame sent has its retransmission timer,
+// else timeouts are looked for on every frame and every rto/4 when idle
+int init_arq (t_arq* a, t_line* line, int window, float rto,
+        const t_arq_callbacks* cb, void* userdata);
+// queue message (up to ARQ_MAXMSG bytes); 0 if window is full.
+// from outside of line callbacks in a reactor, call reactor_update_line()
+int arq_send (t_arq* a, uc* msg, int len);
+// messages sent but not acknowledged yet
+int arq_inflight (t_arq* a);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
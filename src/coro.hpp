@@ -0,0 +1,418 @@
+/*
+ * libtrivdl coroutines: co_await send, recv and timeouts on a line,
+ * C++20, POSIX only.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+#ifndef CORO_HPP
+#define CORO_HPP
+
+#include "libtrivdl.h"
+#include "timer.h"
+#include "reactor.h"
+#include <coroutine>
+#include <cstddef>
+#include <cstring>
+#include <exception>
+#include <new>
+
+// co_line takes the line over, as ARQ does: it installs its own callbacks
+// and userdata, and coroutines (trivdl::task) await frames on it:
+//
+//   trivdl::task client (trivdl::co_line& l)
+//   {
+//       co_await l.send (req, len);            // 1 when the frame is out
+//       n = co_await l.recv (buf, sizeof(buf), 0.5);  // -1 on timeout
+//   }
+//
+// the line is run by its machine (async_machine() or a reactor) as before,
+// and suspended coroutines are resumed right from its callbacks and timers,
+// in the machine thread, with no threads or queues in between. awaiting
+// allocates nothing: the state of an operation lives in the coroutine
+// frame, and frames come from per-thread free lists (frame_allocator).
+// sends go out in the order they were awaited, one frame at a time;
+// received frames go to waiting recv() calls in the order of waiting, so
+// several coroutines may pipeline requests and replies on one line.
+// a frame nobody waits for is held, and the machine stops reading the line
+// until recv() takes it. damaged frames are dropped and counted.
+// timeouts run on line->timers, co_line attaches a wheel of its own if
+// the line has none. under a reactor, pass it to co_line, so operations
+// started outside callbacks of the line (e.g. from another line) wake it up.
+// destroying co_line gives the line its callbacks, userdata and timers
+// back; coroutines still awaiting on it are never resumed then
+#ifdef STATIC_CALLBACKS
+#error "coro.hpp needs per-line callbacks, build without STATIC_CALLBACKS"
+#endif
+#if RXQLEN > 0
+#error "coro.hpp holds rx frame, build with RXQLEN 0"
+#endif
+
+// coroutine frames up to CO_FRAME bytes are taken from free lists,
+// CO_CHUNK blocks are allocated at once when a list is empty
+#ifndef CO_FRAME
+#define CO_FRAME    512
+#endif
+#ifndef CO_CHUNK
+#define CO_CHUNK    64
+#endif
+
+namespace trivdl {
+
+// free list of coroutine frames of this thread. blocks are never given
+// back to the heap while the thread runs, so once as many tasks as ever
+// run at a time have started, starting a task costs no heap. reserve()
+// at startup to have none at all. larger frames go to operator new
+class frame_allocator {
+    union block {
+        block* next;
+        alignas(std::max_align_t) unsigned char data[CO_FRAME];
+    };
+    block* free_ = nullptr;
+    block* chunks_ = nullptr;   // first block of a chunk links chunks
+
+    void grow ()
+    {
+        block* c = static_cast<block*> (::operator new (sizeof(block) * (CO_CHUNK + 1)));
+        c->next = chunks_;
+        chunks_ = c;
+        for (int i = 1; i <= CO_CHUNK; i++) {
+            c[i].next = free_;
+            free_ = c + i;
+        }
+        blocks += CO_CHUNK;
+    }
+
+public:
+    std::size_t blocks = 0, used = 0, peak = 0;
+    unsigned long large = 0;    // frames larger than CO_FRAME
+
+    static frame_allocator& local ()
+    {
+        thread_local frame_allocator a;
+        return a;
+    }
+
+    ~frame_allocator ()
+    {
+        while (chunks_) {
+            block* c = chunks_;
+            chunks_ = c->next;
+            ::operator delete (c);
+        }
+    }
+
+    // have n blocks free
+    void reserve (std::size_t n)
+    {
+        while (blocks - used < n)
+            grow ();
+    }
+
+    void* alloc (std::size_t size)
+    {
+        block* b;
+        if (size > CO_FRAME) {
+            large++;
+            return ::operator new (size);
+        }
+        if (!free_)
+            grow ();
+        b = free_;
+        free_ = b->next;
+        if (++used > peak)
+            peak = used;
+        return b;
+    }
+
+    void free (void* p, std::size_t size)
+    {
+        block* b = static_cast<block*> (p);
+        if (size > CO_FRAME) {
+            ::operator delete (p);
+            return;
+        }
+        b->next = free_;
+        free_ = b;
+        used--;
+    }
+};
+
+
+// coroutine which starts at once and runs on its own: the machines of
+// the lines it awaits resume it, and its frame is freed when it returns.
+// an exception out of it terminates the program. it must return in
+// the thread it was started in
+struct task {
+    struct promise_type {
+        task get_return_object () { return {}; }
+        std::suspend_never initial_suspend () noexcept { return {}; }
+        std::suspend_never final_suspend () noexcept { return {}; }
+        void return_void () {}
+        void unhandled_exception () { std::terminate (); }
+
+        static void* operator new (std::size_t size)
+        {
+            return frame_allocator::local ().alloc (size);
+        }
+        static void operator delete (void* p, std::size_t size)
+        {
+            frame_allocator::local ().free (p, size);
+        }
+    };
+};
+
+
+class co_line {
+    // awaiting operation, in a circular list with the head in co_line
+    struct op {
+        op* prev = this;
+        op* next = this;
+        std::coroutine_handle<> h;
+        int result = 0;
+
+        op () = default;
+        op (const op&) = delete;
+        bool queued () const { return next != this; }
+        void push (op* o)   // o to the tail of this list
+        {
+            o->prev = prev;
+            o->next = this;
+            prev->next = o;
+            prev = o;
+        }
+        void unlink ()
+        {
+            prev->next = next;
+            next->prev = prev;
+            prev = next = this;
+        }
+        op* front () { return queued () ? next : nullptr; }
+    };
+
+    // line whose callback or timer is running in this thread
+    static inline thread_local co_line* current = nullptr;
+
+    struct scope {
+        co_line* saved;
+        scope (co_line* l) : saved (current) { current = l; }
+        ~scope () { current = saved; }
+    };
+
+public:
+    class send_op : op {
+        friend class co_line;
+        co_line& l;
+        const void* src;
+        std::size_t size;
+
+    public:
+        send_op (co_line& l, const void* src, std::size_t size)
+                : l (l), src (src), size (size) {}
+        bool await_ready ()
+        {
+            result = 0;
+            return size > MAXMSG;
+        }
+        void await_suspend (std::coroutine_handle<> h)
+        {
+            this->h = h;
+            l.sendq.push (this);
+            l.tx_next ();
+        }
+        // 1 when the frame is out, 0 if the message is too long
+        int await_resume () { return result; }
+    };
+
+    class recv_op : op {
+        friend class co_line;
+        co_line& l;
+        void* dst;
+        std::size_t size;
+        float timeout;
+        t_timer timer;
+
+        // copy out rx frame and release it
+        void take ()
+        {
+            t_line* line = l.line;
+            result = LRMSGLEN;
+            std::memcpy (dst, &LRMSG, (std::size_t)result < size ? result : size);
+            LRFLAGS &= ~READY;
+            l.held = false;
+        }
+
+        static void expired (t_timer* t)
+        {
+            recv_op* o = static_cast<recv_op*> (t->userdata);
+            scope s (&o->l);
+            o->unlink ();
+            o->result = -1;
+            o->h.resume ();
+        }
+
+    public:
+        recv_op (co_line& l, void* dst, std::size_t size, float timeout)
+                : l (l), dst (dst), size (size), timeout (timeout)
+        {
+            init_timer (&timer, expired, this);
+        }
+        bool await_ready ()
+        {
+            if (!l.held)
+                return false;
+            take ();
+            l.kick ();  // bytes after the frame are left to decode
+            return true;
+        }
+        void await_suspend (std::coroutine_handle<> h)
+        {
+            this->h = h;
+            l.recvq.push (this);
+            if (timeout > 0) {
+                timer_start (l.line->timers, &timer, timeout, 0);
+                l.kick ();
+            }
+        }
+        // length of the message (only size bytes of it are copied),
+        // -1 on timeout
+        int await_resume () { return result; }
+    };
+
+    class sleep_op {
+        co_line& l;
+        float delay;
+        t_timer timer;
+        std::coroutine_handle<> h;
+
+        static void expired (t_timer* t)
+        {
+            sleep_op* o = static_cast<sleep_op*> (t->userdata);
+            scope s (&o->l);
+            o->h.resume ();
+        }
+
+    public:
+        sleep_op (co_line& l, float delay) : l (l), delay (delay)
+        {
+            init_timer (&timer, expired, this);
+        }
+        bool await_ready () { return delay <= 0; }
+        void await_suspend (std::coroutine_handle<> h)
+        {
+            this->h = h;
+            timer_start (l.line->timers, &timer, delay, 0);
+            l.kick ();
+        }
+        void await_resume () {}
+    };
+
+    t_line* line;
+    t_reactor* reactor;
+    unsigned long damaged = 0;  // frames dropped
+    float idle = 1.0;           // what cb_idle() returns
+
+    co_line (t_line* line, t_reactor* r = nullptr)
+            : line (line), reactor (r), saved_cb (line->cb), saved_userdata (line->userdata)
+    {
+        static const t_callbacks cb = { rx_done, tx_done, idle_cb };
+        if (!line->timers) {
+            init_wheel (&wheel);
+            line->timers = &wheel;
+        }
+        line->cb = &cb;
+        line->userdata = this;
+    }
+    ~co_line ()
+    {
+        line->cb = saved_cb;
+        line->userdata = saved_userdata;
+        if (line->timers == &wheel)
+            line->timers = nullptr;
+    }
+    co_line (const co_line&) = delete;
+    co_line& operator= (const co_line&) = delete;
+
+    // build a frame of size bytes at src and send it
+    send_op send (const void* src, std::size_t size) { return send_op (*this, src, size); }
+    // wait for a frame, up to timeout seconds if timeout > 0
+    recv_op recv (void* dst, std::size_t size, float timeout = 0)
+    {
+        return recv_op (*this, dst, size, timeout);
+    }
+    sleep_op sleep (float seconds) { return sleep_op (*this, seconds); }
+
+private:
+    op sendq, recvq;
+    bool tx_busy = false;   // frame of sendq head is in wfr
+    bool held = false;      // rx frame waits for recv()
+    t_wheel wheel;
+    const t_callbacks* saved_cb;    // of the line before co_line
+    void* saved_userdata;
+
+    // state changed outside callbacks of the line: reactor must look at it
+    void kick ()
+    {
+        if (reactor && current != this)
+            reactor_update_line (reactor, line);
+    }
+
+    void tx_next ()
+    {
+        send_op* o = static_cast<send_op*> (sendq.front ());
+        if (tx_busy || !o)
+            return;
+        build_frame (&line->wfr, (uc*)o->src, o->size);
+        line->wfr.next = SIGNATURE;
+        line->wfr.flags |= READY;
+        tx_busy = true;
+        kick ();
+    }
+
+    static void rx_done (uc status, t_line* line)
+    {
+        co_line* l = static_cast<co_line*> (line->userdata);
+        recv_op* o = static_cast<recv_op*> (l->recvq.front ());
+        scope s (l);
+
+        if (status != FROK) {
+            l->damaged++;
+            LRFLAGS &= ~READY;
+            return;
+        }
+        if (!o) {
+            l->held = true; // READY stays, the machine stops reading
+            return;
+        }
+        o->unlink ();
+        timer_stop (&o->timer);
+        o->take ();
+        o->h.resume ();
+    }
+
+    static void tx_done (uc, t_line* line)
+    {
+        co_line* l = static_cast<co_line*> (line->userdata);
+        send_op* o = static_cast<send_op*> (l->sendq.front ());
+        scope s (l);
+
+        l->tx_busy = false;
+        if (!o)
+            return;
+        o->unlink ();
+        l->tx_next ();  // keep the line busy while o runs
+        o->result = 1;
+        o->h.resume ();
+    }
+
+    static float idle_cb (t_line* line)
+    {
+        return static_cast<co_line*> (line->userdata)->idle;
+    }
+};
+
+} // namespace trivdl
+
+#endif
@@ -0,0 +1,197 @@
+/*
+ * libtrivdl fragmentation implementation.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+// fragmentation needs per-line callbacks, frag.h refuses STATIC_CALLBACKS
+#ifndef STATIC_CALLBACKS
+
+#include "frag.h"
+
+static void frag_rx_done (uc status, t_line* line);
+static void frag_tx_done (uc status, t_line* line);
+static float frag_idle (t_line* line);
+static const t_callbacks frag_callbacks = { frag_rx_done, frag_tx_done, frag_idle };
+
+
+void init_frag (t_frag* f, t_line* line, const t_frag_callbacks* cb, void* userdata)
+{
+    memset (f, 0, sizeof(*f));
+    f->line = line;
+    f->cb = cb;
+    f->userdata = userdata;
+    line->cb = &frag_callbacks;
+    line->userdata = f;
+}
+
+
+// build next fragment right in wfr, so there is no gap on the wire
+static void frag_pump (t_frag* f)
+{
+    t_line* line = f->line;
+    t_frag_msg* m;
+    uc* d = &LWMSG;
+    int off, n;
+
+    if ((LWFLAGS & READY) || !f->txcount)
+        return;
+    m = f->txq + f->txhead;
+    if (f->txidx == 0)
+        f->txcnt = m->len ? (m->len + FRAG_CHUNK - 1) / FRAG_CHUNK : 1;
+    off = f->txidx * FRAG_CHUNK;
+    n = m->len - off < FRAG_CHUNK ? m->len - off : FRAG_CHUNK;
+    d[0] = f->txid;
+    d[1] = (uc)f->txidx;
+    d[2] = f->txidx >> 8;
+    d[3] = (uc)f->txcnt;
+    d[4] = f->txcnt >> 8;
+    memcpy (d + FRAG_HDR, m->msg + off, n);
+    f->txidx++;
+    finalize_frame (LWFR, FRAG_HDR + n);
+    LWNEXT = SIGNATURE;
+    LWFLAGS |= READY;
+}
+
+
+int frag_send (t_frag* f, uc* msg, int len)
+{
+    t_frag_msg* m;
+    if (f->txcount == FRAG_TXQ || len > FRAG_MAXMSG)
+        return 0;
+    m = f->txq + (f->txhead + f->txcount) % FRAG_TXQ;
+    m->msg = msg;
+    m->len = len;
+    f->txcount++;
+    frag_pump (f);
+    return 1;
+}
+
+
+static void frag_tx_done (uc status, t_line* line)
+{
+    t_frag* f = line->userdata;
+    t_frag_msg m;
+
+    (void)status;
+    if (f->txcount && f->txidx == f->txcnt) {
+        // last fragment is out
+        m = f->txq[f->txhead];
+        f->txhead = (f->txhead + 1) % FRAG_TXQ;
+        f->txcount--;
+        f->txidx = 0;
+        f->txid++;
+        f->sent++;
+        frag_pump (f); // next message first, then tell user code
+        if (f->cb->cb_msg_sent)
+            f->cb->cb_msg_sent (f, m.msg, m.len);
+    }
+    frag_pump (f);
+}
+
+
+int frag_recv (t_frag* f, uc* buf, int size)
+{
+    if (f->rxactive)
+        return 0;
+    f->rxbuf = buf;
+    f->rxsize = size;
+    return 1;
+}
+
+
+// report current message and return its buffer to user code
+static void frag_finish (t_frag* f)
+{
+    uc* buf = f->rxbuf;
+    uc status;
+
+    if (f->rxerr)
+        status = f->rxerr;
+    else if (f->rxgot < f->rxcnt)
+        status = FRAG_LOST;
+    else
+        status = FRAG_OK;
+    if (status == FRAG_OK)
+        f->received++;
+    else
+        f->lost++;
+    f->rxactive = false;
+    f->rxbuf = NULL;
+    f->cb->cb_msg_rx (f, buf, f->rxlen, status);
+}
+
+
+static void frag_start (t_frag* f, uc id, uint16_t cnt)
+{
+    uc gap = id - f->rxnext;
+
+    // messages lost entirely are only counted (a backward
+    // step is taken for a restarted peer)
+    if (f->rxseen && gap < 128)
+        f->lost += gap;
+    f->rxseen = true;
+    f->rxnext = id + 1;
+    f->rxactive = true;
+    f->rxid = id;
+    f->rxcnt = cnt;
+    f->rxgot = 0;
+    f->rxlen = 0;
+    f->rxerr = 0;
+    if (!f->rxbuf || cnt > FRAG_MAXFRAGS || (cnt - 1) * FRAG_CHUNK > f->rxsize)
+        f->rxerr = FRAG_NOBUF; // drop the message
+    else
+        memset (f->rxmap, 0, (cnt + 7) / 8);
+}
+
+
+static void frag_rx_done (uc status, t_line* line)
+{
+    t_frag* f = line->userdata;
+    uc* d = &LRMSG;
+    int n = LRMSGLEN - FRAG_HDR;
+    uint16_t idx, cnt;
+    int off;
+
+    // damaged fragment is found missing when message ends
+    if (status != FROK || n < 0)
+        goto release;
+    idx = d[1] | d[2] << 8;
+    cnt = d[3] | d[4] << 8;
+    if (!cnt)
+        goto release;
+    if (f->rxactive && (d[0] != f->rxid || cnt != f->rxcnt))
+        frag_finish (f); // the rest of previous message is lost
+    if (!f->rxactive)
+        frag_start (f, d[0], cnt);
+    off = idx * FRAG_CHUNK;
+    if (idx == cnt - 1 && off + n > f->rxsize)
+        f->rxerr = FRAG_NOBUF;
+    if (!f->rxerr && idx < cnt && !(f->rxmap[idx / 8] & (1 << (idx % 8)))
+            && (idx == cnt - 1 ? n <= FRAG_CHUNK : n == FRAG_CHUNK)) {
+        memcpy (f->rxbuf + off, d + FRAG_HDR, n);
+        f->rxmap[idx / 8] |= 1 << (idx % 8);
+        f->rxgot++;
+        if (idx == cnt - 1)
+            f->rxlen = off + n;
+    }
+    if (idx >= cnt - 1)
+        frag_finish (f);
+release:
+    LRFLAGS &= ~READY;
+}
+
+
+// line was quiet for a second: the tail of message is lost
+static float frag_idle (t_line* line)
+{
+    t_frag* f = line->userdata;
+    if (f->rxactive)
+        frag_finish (f);
+    frag_pump (f);
+    return 1.0;
+}
+
+#endif
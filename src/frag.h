@@ -0,0 +1,99 @@
+/*
+ * libtrivdl fragmentation: messages larger than a frame, POSIX only.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+#ifndef FRAG_H
+#define FRAG_H
+
+#include "libtrivdl.h"
+
+#ifdef STATIC_CALLBACKS
+#error "frag.h needs per-line callbacks, build without STATIC_CALLBACKS"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// fragmentation takes the line over, as ARQ does.
+// message of each frame starts with fragment header:
+//   id  index (2 bytes)  count (2 bytes)  chunk...
+// (2-byte values little endian). all chunks but the last are FRAG_CHUNK
+// bytes, so that receiver puts chunk at index*FRAG_CHUNK in its buffer.
+#define FRAG_HDR        5
+#define FRAG_CHUNK      (MAXFRAMESIZE - OVERHEAD - FRAG_HDR)
+
+// fragments per message (limits the message to FRAG_MAXMSG bytes)
+#ifndef FRAG_MAXFRAGS
+#define FRAG_MAXFRAGS   1024
+#endif
+#define FRAG_MAXMSG     (FRAG_MAXFRAGS * FRAG_CHUNK)
+
+// messages waiting for transmission
+#ifndef FRAG_TXQ
+#define FRAG_TXQ        4
+#endif
+
+// message status, see t_frag_callbacks
+#define FRAG_OK         0
+#define FRAG_LOST       1   // some fragments did not arrive
+#define FRAG_NOBUF      2   // no buffer posted, or too small
+
+typedef struct {
+    uc* msg;
+    int len;
+} t_frag_msg;
+
+struct s_frag;
+typedef struct {
+    // message received into buffer given to frag_recv() (or NULL if
+    // none was posted), which is returned to user code. len is the
+    // message length, or 0 if its last fragment did not arrive
+    void (*cb_msg_rx) (struct s_frag* f, uc* buf, int len, uc status);
+    // message given to frag_send() is transmitted and may be reused
+    void (*cb_msg_sent) (struct s_frag* f, uc* msg, int len);
+} t_frag_callbacks;
+
+typedef struct s_frag {
+    t_line* line;
+    const t_frag_callbacks* cb;
+    void* userdata;
+    // tx: txq[txhead] is being sent, its fragment txidx is next
+    t_frag_msg txq[FRAG_TXQ];
+    uc txhead, txcount;
+    uc txid;
+    uint16_t txidx, txcnt;
+    // rx: message rxid goes to rxbuf, unless rxerr
+    uc* rxbuf;
+    int rxsize;
+    bool rxactive;
+    uc rxerr;           // FRAG_NOBUF if message is dropped
+    uc rxid;
+    uc rxnext;          // id expected next
+    bool rxseen;        // rxnext is valid
+    uint16_t rxcnt, rxgot;
+    int rxlen;
+    uc rxmap[FRAG_MAXFRAGS / 8];   // received fragments
+    // counters
+    unsigned long sent, received, lost; // messages
+} t_frag;
+
+// attach to initialized line (fd set, not running)
+void init_frag (t_frag* f, t_line* line, const t_frag_callbacks* cb, void* userdata);
+// queue message for transmission; it must stay intact until cb_msg_sent().
+// 0 if queue is full or message is longer than FRAG_MAXMSG.
+// from outside of line callbacks in a reactor, call reactor_update_line()
+int frag_send (t_frag* f, uc* msg, int len);
+// buffer for the next message, typically posted again in cb_msg_rx().
+// 0 while a message is being received
+int frag_recv (t_frag* f, uc* buf, int size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -7,22 +7,374 @@
  */
 
 #include "libtrivdl.h"
+// memchr, memcpy
+#include <string.h>
+#ifndef MCU
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+#endif
+#if defined(LATENCY) || !defined(MCU)
+// clock_gettime
+#include <time.h>
+#endif
+#ifndef MCU
+#include "timer.h"
+#include "tap.h"
+// INFINITY
+#include <math.h>
+#endif
+#if SUBMITQLEN > 0
+#include <sys/eventfd.h>
+#endif
+
+
+// CRC: slicing-by-8 tables in POSIX, bit by bit in MCU to save flash.
+// CRC-32C uses crc32 instruction where available.
+#define CRC16_POLY      0x1021
+#define CRC32C_POLY     0x82F63B78  // reflected
+
+#ifndef MCU
+static uint16_t crc16_tab[8][256];
+#ifndef __SSE4_2__
+static uint32_t crc32c_tab[8][256];
+#endif
+
+static void __attribute__((constructor)) init_crc (void)
+{
+    int n, k;
+    uint16_t c16;
+    uint32_t c32;
+    for (n = 0; n < 256; n++) {
+        c16 = n << 8;
+        c32 = n;
+        for (k = 0; k < 8; k++) {
+            c16 = (c16 & 0x8000) ? (c16 << 1) ^ CRC16_POLY : c16 << 1;
+            c32 = (c32 & 1) ? (c32 >> 1) ^ CRC32C_POLY : c32 >> 1;
+        }
+        crc16_tab[0][n] = c16;
+#ifndef __SSE4_2__
+        crc32c_tab[0][n] = c32;
+#endif
+    }
+    // tab[k][n]: n followed by k zero bytes
+    for (k = 1; k < 8; k++)
+        for (n = 0; n < 256; n++) {
+            c16 = crc16_tab[k-1][n];
+            crc16_tab[k][n] = (c16 << 8) ^ crc16_tab[0][c16 >> 8];
+#ifndef __SSE4_2__
+            c32 = crc32c_tab[k-1][n];
+            crc32c_tab[k][n] = (c32 >> 8) ^ crc32c_tab[0][c32 & 0xff];
+#endif
+        }
+}
+#endif
+
+
+static inline uint16_t crc16_byte (uint16_t crc, uc c)
+{
+#ifdef MCU
+    int k;
+    crc ^= c << 8;
+    for (k = 0; k < 8; k++)
+        crc = (crc & 0x8000) ? (crc << 1) ^ CRC16_POLY : crc << 1;
+    return crc;
+#else
+    return (crc << 8) ^ crc16_tab[0][(crc >> 8) ^ c];
+#endif
+}
+
+
+static inline uint32_t crc32c_byte (uint32_t crc, uc c)
+{
+#if defined(MCU)
+    int k;
+    crc ^= c;
+    for (k = 0; k < 8; k++)
+        crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    return crc;
+#elif defined(__SSE4_2__)
+    return _mm_crc32_u8 (crc, c);
+#else
+    return (crc >> 8) ^ crc32c_tab[0][(crc ^ c) & 0xff];
+#endif
+}
+
+
+uint16_t crc16_update (uint16_t crc, const uc* p, int n)
+{
+#ifndef MCU
+    uint16_t x;
+    for (; n >= 8; n -= 8, p += 8) {
+        x = crc ^ (p[0] << 8 | p[1]);
+        crc = crc16_tab[7][x >> 8] ^ crc16_tab[6][x & 0xff]
+            ^ crc16_tab[5][p[2]] ^ crc16_tab[4][p[3]]
+            ^ crc16_tab[3][p[4]] ^ crc16_tab[2][p[5]]
+            ^ crc16_tab[1][p[6]] ^ crc16_tab[0][p[7]];
+    }
+#endif
+    while (n-- > 0)
+        crc = crc16_byte (crc, *p++);
+    return crc;
+}
+
+
+uint32_t crc32c_update (uint32_t crc, const uc* p, int n)
+{
+#if !defined(MCU) && defined(__SSE4_2__) && defined(__x86_64__)
+    uint64_t q;
+    for (; n >= 8; n -= 8, p += 8) {
+        memcpy (&q, p, 8);
+        crc = _mm_crc32_u64 (crc, q);
+    }
+#elif !defined(MCU) && !defined(__SSE4_2__)
+    uint32_t lo, hi;
+    for (; n >= 8; n -= 8, p += 8) {
+        lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+        hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+        crc = crc32c_tab[7][lo & 0xff] ^ crc32c_tab[6][(lo >> 8) & 0xff]
+            ^ crc32c_tab[5][(lo >> 16) & 0xff] ^ crc32c_tab[4][lo >> 24]
+            ^ crc32c_tab[3][hi & 0xff] ^ crc32c_tab[2][(hi >> 8) & 0xff]
+            ^ crc32c_tab[1][(hi >> 16) & 0xff] ^ crc32c_tab[0][hi >> 24];
+    }
+#endif
+    while (n-- > 0)
+        crc = crc32c_byte (crc, *p++);
+    return crc;
+}
+
+
+static inline uc sum_update (uc cs, const uc* p, int n)
+{
+    while (n-- > 0)
+        cs += *p++;
+    return cs;
+}
+
+
+// configured checksum: running value is folded byte by byte (CK_STEP)
+// or by blocks (CK_BLOCK), then CK_FINAL gives what is sent
+#if CHECKSUM == CK_CRC32C
+#define CK_INIT             0xFFFFFFFF
+#define CK_STEP(x,c)        crc32c_byte (x, c)
+#define CK_BLOCK(x,p,n)     crc32c_update (x, p, n)
+#define CK_FINAL(x)         (~(x))
+#elif CHECKSUM == CK_CRC16
+#define CK_INIT             0xFFFF
+#define CK_STEP(x,c)        crc16_byte (x, c)
+#define CK_BLOCK(x,p,n)     crc16_update (x, p, n)
+#define CK_FINAL(x)         (x)
+#else
+#define CK_INIT             0
+#define CK_STEP(x,c)        ((uc)((x) + (c)))
+#define CK_BLOCK(x,p,n)     sum_update (x, p, n)
+#define CK_FINAL(x)         (x)
+#endif
+
+
+// checksum stored at p, little endian
+static inline t_cksum get_ck (uc* p)
+{
+    t_cksum ck = 0;
+    int k;
+    for (k = CKSIZE - 1; k >= 0; k--)
+        ck = (ck << 8) | p[k];
+    return ck;
+}
+
+
+static inline void put_ck (uc* p, t_cksum ck)
+{
+    int k;
+    for (k = 0; k < CKSIZE; k++) {
+        p[k] = (uc)ck;
+        ck >>= 8;
+    }
+}
+
+
+#ifdef LATENCY
+uint64_t lat_now ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static inline int lat_bucket (uint64_t v)
+{
+    int e;
+    if (v < (1 << LAT_SUBBITS))
+        return v;
+    e = 63 - __builtin_clzll (v);
+    if (e >= 40)
+        return LAT_BUCKETS - 1;
+    return ((e - LAT_SUBBITS + 1) << LAT_SUBBITS)
+        + ((v >> (e - LAT_SUBBITS)) & ((1 << LAT_SUBBITS) - 1));
+}
+
+
+// highest value counted in bucket b
+static uint64_t lat_bucket_top (int b)
+{
+    int e;
+    if (b < (1 << LAT_SUBBITS))
+        return b;
+    e = (b >> LAT_SUBBITS) + LAT_SUBBITS - 1;
+    return ((uint64_t)((1 << LAT_SUBBITS) + (b & ((1 << LAT_SUBBITS) - 1)) + 1)
+            << (e - LAT_SUBBITS)) - 1;
+}
+
+
+void lat_add (t_hist* h, uint64_t ns)
+{
+    h->count[lat_bucket (ns)]++;
+    h->total++;
+    if (ns > h->max)
+        h->max = ns;
+}
+
+
+uint64_t lat_quantile (const t_hist* h, double q)
+{
+    uint64_t rank, seen = 0;
+    int b;
+    if (!h->total)
+        return 0;
+    rank = q * h->total;
+    if (rank < q * h->total || rank == 0)
+        rank++;
+    for (b = 0; b < LAT_BUCKETS; b++) {
+        seen += h->count[b];
+        if (seen >= rank)
+            return lat_bucket_top (b) < h->max ? lat_bucket_top (b) : h->max;
+    }
+    return h->max;
+}
+
+
+void lat_dump (FILE* f, const char* name, const t_hist* h)
+{
+    fprintf (f, "%s: %llu frames, us: p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+            name, (unsigned long long)h->total,
+            lat_quantile (h, 0.5) / 1e3, lat_quantile (h, 0.9) / 1e3,
+            lat_quantile (h, 0.99) / 1e3, lat_quantile (h, 0.999) / 1e3,
+            h->max / 1e3);
+}
+
+
+static inline void lat_tx_start (t_line* line)
+{
+    line->lat.tx_first = lat_now ();
+    if (line->wfr.built)
+        lat_add (&line->lat.queue, line->lat.tx_first - line->wfr.built);
+}
+
+
+static inline void lat_tx_end (t_line* line)
+{
+    line->lat.tx_last = lat_now ();
+    lat_add (&line->lat.tx, line->lat.tx_last - line->lat.tx_first);
+}
+
+
+static inline void lat_rx_end (t_line* line)
+{
+    line->lat.rx_done = lat_now ();
+    lat_add (&line->lat.rx, line->lat.rx_done - line->lat.rx_first);
+}
+
+#define LAT(x)      x
+#else
+#define LAT(x)
+#endif
+
+#if STATS
+#define ST(x)       x
+
+void line_stats (t_line* line, t_stats* st, bool reset)
+{
+    *st = line->stats;
+    if (reset)
+        memset (&line->stats, 0, sizeof(line->stats));
+}
+#else
+#define ST(x)
+#endif
+
 
 void init_frame (t_frame* fr)
 {
     fr->next=0;
     fr->flags=0;
+    fr->cs=CK_INIT;
+#ifdef LATENCY
+    fr->built=0;
+#endif
 }
 
 
+#ifdef MCU
 int init_line (t_line* line, char* portname, void* userdata)
+#else
+int init_line (t_line* line, char* portname, void* userdata, const t_callbacks* cb)
+#endif
 {
+#if SUBMITQLEN > 0
+    int i;
+#endif
 #ifndef MCU
-    line->fd = open(portname, O_RDWR | O_NOCTTY | O_SYNC);
-    if (line->fd < 0) {
+    // without port, bytes may be supplied by incoming_chars()
+    line->fd = portname ? open(portname, O_RDWR | O_NOCTTY | O_SYNC) : -1;
+    if (portname && line->fd < 0) {
         err("error opening %s: %s\n", portname, strerror(errno));
         return 0;
     }
+#ifndef STATIC_CALLBACKS
+    line->cb = cb;
+#endif
+    line->rxpos = line->rxlen = 0;
+    line->txpos = line->txlen = 0;
+    line->timers = NULL;
+    line->tap = NULL;
+#endif
+#if TXQLEN > 0
+    line->txqhead = line->txqcount = 0;
+    line->txqfull = 0;
+#endif
+#if SUBMITQLEN > 0
+    for (i = 0; i < SUBMITQLEN; i++)
+        line->sq[i].seq = i;
+    line->sqtail = line->sqhead = 0;
+    line->sqwake = 0;
+    line->sqfull = 0;
+    line->sqfd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (line->sqfd < 0) {
+        err("eventfd: %s\n", strerror(errno));
+        // port was opened above
+        if (line->fd >= 0)
+            close (line->fd);
+        line->fd = -1;
+        return 0;
+    }
+#endif
+#if RXQLEN > 0
+    line->rxqhead = line->rxqtail = 0;
+    line->rxqover = 0;
+#endif
+#if STATS
+    memset (&line->stats, 0, sizeof(line->stats));
+#endif
+#ifdef LATENCY
+    memset (&line->lat, 0, sizeof(line->lat));
 #endif
     line->lflags = 0;
     line->userdata = userdata;
@@ -32,164 +384,521 @@ int init_line (t_line* line, char* portname, void* userdata)
 }
 
 
-uc compute_checksum (t_frame* fr)
+t_cksum compute_checksum (t_frame* fr)
 {
-    volatile uc pc, cs;
-    cs=0;
-    for (pc=LASTNDX; pc<FRLAST; pc++) {
-        cs+=DATA[pc];
-    }
-    return cs;
+    return CK_FINAL(CK_BLOCK(CK_INIT, DATA + LASTNDX, CKNDX(DATA) - LASTNDX));
 }
 
 
 void add_hdr_and_checksum (t_frame* fr)
 {
     DATA[SIGNATURE] = FRAMEDELIMITER;
-    DATA[FRLAST] = compute_checksum (fr);
+    put_ck (DATA + CKNDX(DATA), compute_checksum (fr));
+    LAT(fr->built = lat_now ());
 }
 
 
-t_frame* build_frame (t_frame* fr, uc* src, uc size)
+t_frame* build_frame (t_frame* fr, uc* src, t_size size)
 {
-    uc c, srci, dsti, cs;
     init_frame (fr);
-    (fr->data)[SIGNATURE] = FRAMEDELIMITER;
-    cs = 0;
-    dsti = MESSAGE;
-    for (srci=0; srci<size; srci++) {
-        c = *(src+srci);
-        if (dsti > (MAXFRAMESIZE-2))
+    if (size > MAXMSG)
+        return NULL; // overflow
+    memcpy (DATA + MESSAGE, src, size);
+    return finalize_frame (fr, size);
+}
+
+
+uc* frame_payload (t_frame* fr)
+{
+    init_frame (fr);
+    return DATA + MESSAGE;
+}
+
+
+t_frame* finalize_frame (t_frame* fr, t_size size)
+{
+    if (size > MAXMSG)
+        return NULL; // overflow
+    SETLAST(DATA, MESSAGE + size + CKSIZE - 1);
+    add_hdr_and_checksum (fr);
+    return fr;
+}
+
+
+t_frame* build_framev (t_frame* fr, const t_iovec* iov, int n)
+{
+    uc* d = frame_payload (fr);
+    unsigned size = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (iov[i].len > MAXMSG - size)
             return NULL; // overflow
-        (fr->data)[dsti] = c;
-        cs += c;
-        dsti++;
+        memcpy (d + size, iov[i].base, iov[i].len);
+        size += iov[i].len;
     }
-    (fr->data)[LASTNDX] = dsti;
-    cs += dsti;
-    (fr->data)[dsti] = cs;
-    return fr;
+    return finalize_frame (fr, size);
+}
+
+
+#if TXQLEN > 0
+t_frame* txq_reserve (t_line* line)
+{
+    uc slot;
+    if (line->txqcount == TXQLEN) {
+        line->txqfull++;
+        return NULL;
+    }
+    slot = line->txqhead + line->txqcount;
+    if (slot >= TXQLEN)
+        slot -= TXQLEN;
+    return line->txq + slot;
+}
+
+
+void txq_commit (t_line* line)
+{
+    line->txqcount++;
+}
+
+
+int send_frame (t_line* line, uc* src, t_size size)
+{
+    t_frame* fr = txq_reserve (line);
+    if (!fr || !build_frame (fr, src, size))
+        return 0;
+    txq_commit (line);
+    return 1;
+}
+
+
+int txq_next (t_line* line)
+{
+    t_frame* fr;
+    if ((LWFLAGS & READY) || !line->txqcount)
+        return 0;
+    fr = line->txq + line->txqhead;
+    // copy, so that wfr shortcuts work in callbacks as usual
+    memcpy (LWDATA, DATA, FRLAST + 1);
+    LAT(line->wfr.built = fr->built);
+    LWNEXT = SIGNATURE;
+    LWFLAGS = READY;
+    if (++line->txqhead == TXQLEN)
+        line->txqhead = 0;
+    line->txqcount--;
+    return 1;
 }
+#endif
+
 
+#if SUBMITQLEN > 0
+// bounded MPMC queue of D. Vyukov, with a single consumer.
+// slot at position pos is free for producer if seq == pos,
+// holds a frame for consumer if seq == pos + 1
+int submit_frame (t_line* line, uc* src, t_size size)
+{
+    uint32_t pos, seq;
+    int32_t dif;
+    uint64_t one = 1;
+    int n;
 
+    if (size > MAXMSG)
+        return 0;
+    pos = __atomic_load_n (&line->sqtail, __ATOMIC_RELAXED);
+    for (;;) {
+        seq = __atomic_load_n (&line->sq[pos % SUBMITQLEN].seq, __ATOMIC_ACQUIRE);
+        dif = (int32_t)(seq - pos);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n (&line->sqtail, &pos, pos + 1,
+                    true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            __atomic_fetch_add (&line->sqfull, 1, __ATOMIC_RELAXED);
+            return 0; // full
+        } else {
+            pos = __atomic_load_n (&line->sqtail, __ATOMIC_RELAXED);
+        }
+    }
+    build_frame (&line->sq[pos % SUBMITQLEN].fr, src, size);
+    __atomic_store_n (&line->sq[pos % SUBMITQLEN].seq, pos + 1, __ATOMIC_RELEASE);
+    // one write per sleep of the machine, not per frame
+    if (__atomic_exchange_n (&line->sqwake, 0, __ATOMIC_SEQ_CST)) {
+        n = write (line->sqfd, &one, sizeof(one));
+        (void)n;
+    }
+    return 1;
+}
+
+
+int submitq_next (t_line* line)
+{
+    uint32_t pos = line->sqhead;
+    t_frame* fr = &line->sq[pos % SUBMITQLEN].fr;
+
+    if (LWFLAGS & READY)
+        return 0; // tx will come back here when done
+    // ask for a wakeup before looking, so no frame is missed
+    __atomic_store_n (&line->sqwake, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&line->sq[pos % SUBMITQLEN].seq, __ATOMIC_ACQUIRE) != pos + 1)
+        return 0; // empty
+    memcpy (LWDATA, DATA, FRLAST + 1);
+    LAT(line->wfr.built = fr->built);
+    LWNEXT = SIGNATURE;
+    LWFLAGS = READY;
+    __atomic_store_n (&line->sq[pos % SUBMITQLEN].seq, pos + SUBMITQLEN, __ATOMIC_RELEASE);
+    line->sqhead = pos + 1;
+    return 1;
+}
+
+
+void submitq_clear (t_line* line)
+{
+    uint64_t v;
+    int n = read (line->sqfd, &v, sizeof(v));
+    (void)n;
+}
+#endif
+
+
+#if !defined(MCU) && defined(__SSSE3__)
+// expand[m]: pshufb indices doubling bytes of 8-byte chunk marked in m
+static uc expand[256][16];
+
+static void __attribute__((constructor)) init_expand (void)
+{
+    int m, k, o;
+    for (m = 0; m < 256; m++) {
+        o = 0;
+        for (k = 0; k < 8; k++) {
+            expand[m][o++] = k;
+            if (m & (1 << k))
+                expand[m][o++] = k;
+        }
+        while (o < 16)
+            expand[m][o++] = 0x80; // zero
+    }
+}
+
+// 8 bytes with delimiters doubled, stored as 16 bytes at dst.
+// returns number of valid bytes
+static inline int stuff8 (uc* dst, uc* src, unsigned m)
+{
+    __m128i v = _mm_loadl_epi64 ((__m128i*)src);
+    v = _mm_shuffle_epi8 (v, _mm_loadu_si128 ((__m128i*)expand[m]));
+    _mm_storeu_si128 ((__m128i*)dst, v);
+    return 8 + __builtin_popcount (m);
+}
+#endif
+
+
+// copy n bytes from src to dst doubling FRAMEDELIMITER, return bytes written.
+// vector stores may overrun the result: dst must hold 2*n bytes.
+static int stuff_bytes (uc* dst, uc* src, int n)
+{
+    int i = 0, o = 0;
+#ifndef MCU
+#if defined(__AVX2__)
+    const __m256i delim = _mm256_set1_epi8 ((char)FRAMEDELIMITER);
+    __m256i v;
+    unsigned m;
+    for (; i + 32 <= n; i += 32) {
+        v = _mm256_loadu_si256 ((__m256i*)(src + i));
+        m = _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (v, delim));
+        if (!m) {
+            _mm256_storeu_si256 ((__m256i*)(dst + o), v);
+            o += 32;
+        } else {
+            o += stuff8 (dst + o, src + i, m & 0xff);
+            o += stuff8 (dst + o, src + i + 8, (m >> 8) & 0xff);
+            o += stuff8 (dst + o, src + i + 16, (m >> 16) & 0xff);
+            o += stuff8 (dst + o, src + i + 24, m >> 24);
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i delim = _mm_set1_epi8 ((char)FRAMEDELIMITER);
+    __m128i v;
+    unsigned m;
+#if !defined(__SSSE3__)
+    int k;
+#endif
+    for (; i + 16 <= n; i += 16) {
+        v = _mm_loadu_si128 ((__m128i*)(src + i));
+        m = _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, delim));
+        if (!m) {
+            _mm_storeu_si128 ((__m128i*)(dst + o), v);
+            o += 16;
+        } else {
+#if defined(__SSSE3__)
+            o += stuff8 (dst + o, src + i, m & 0xff);
+            o += stuff8 (dst + o, src + i + 8, m >> 8);
+#else
+            // no branch per byte: write it twice, keep the second copy
+            // only for delimiter
+            for (k = i; k < i + 16; k++) {
+                dst[o] = dst[o+1] = src[k];
+                o += 1 + (src[k] == FRAMEDELIMITER);
+            }
+#endif
+        }
+    }
+#endif
+#endif
+    for (; i < n; i++) {
+        if (src[i] == FRAMEDELIMITER)
+            dst[o++] = FRAMEDELIMITER;
+        dst[o++] = src[i];
+    }
+    return o;
+}
+
+
+// the same bytes outgoing_char() would produce, in one pass.
+// returns wire length.
+int stuff_frame (t_frame* fr, uc* dst)
+{
+    dst[SIGNATURE] = FRAMEDELIMITER;
+    return SIGNATURE + 1 + stuff_bytes (dst + SIGNATURE + 1,
+            DATA + SIGNATURE + 1, FRLAST - SIGNATURE);
+}
+
+
+#if RXQLEN > 0
+// RX queue indices run over 2*RXQLEN, so that full and empty differ.
+// head is written by user code, tail by decoder (ISR in MCU).
 #ifdef MCU
-void incoming_char (uc c)
+#define RXQ_LOAD(x)      (x)
+#define RXQ_STORE(x,v)   ((x) = (v))
 #else
-void incoming_char (t_line* line, uc c)
+#define RXQ_LOAD(x)      __atomic_load_n (&(x), __ATOMIC_ACQUIRE)
+#define RXQ_STORE(x,v)   __atomic_store_n (&(x), (v), __ATOMIC_RELEASE)
 #endif
+#define RXQ_INC(i)       ((i) + 1 == 2*RXQLEN ? 0 : (i) + 1)
+
+// copy finished rfr to the queue, if there is room
+static inline void rxq_put (t_line* line, uc status)
+{
+    uc tail = line->rxqtail;
+    uc head = RXQ_LOAD(line->rxqhead);
+    t_frame* fr;
+    if ((uc)(tail - head) == RXQLEN || (uc)(head - tail) == RXQLEN) {
+        line->rxqover++;
+        return;
+    }
+    fr = line->rxq + (tail < RXQLEN ? tail : tail - RXQLEN);
+    memcpy (DATA, LRDATA, LRNEXT);
+    fr->next = LRNEXT;
+    fr->flags = READY;
+    line->rxqstatus[fr - line->rxq] = status;
+    RXQ_STORE(line->rxqtail, RXQ_INC(tail));
+}
+
+
+t_frame* rxq_get (t_line* line, uc* status)
+{
+    uc head = line->rxqhead;
+    uc slot;
+    if (head == RXQ_LOAD(line->rxqtail))
+        return NULL;
+    slot = head < RXQLEN ? head : head - RXQLEN;
+    if (status)
+        *status = line->rxqstatus[slot];
+    return line->rxq + slot;
+}
+
+
+void rxq_release (t_line* line)
+{
+    RXQ_STORE(line->rxqhead, RXQ_INC(line->rxqhead));
+}
+#endif
+
+
+// completed or failed frame: hand it over to user code
+static inline void rx_done (t_line* line, uc status)
+{
+    t_frame* rfr = &(line->rfr);
+#if RXQLEN > 0
+    rxq_put (line, status);
+#endif
+    LAT(if (status == FROK) lat_rx_end (line));
+    ST(line->stats.rx_frames[status]++);
+    ST(if (status == FROK) line->stats.rx_payload += MSGLEN(RDATA));
+    RFLAGS |= READY;
+    X_DONE(cb_frame_rx_done, status);
+#if RXQLEN > 0
+    // frame is queued (or lost), keep receiving
+    RFLAGS &= ~READY;
+#endif
+}
+
+
+// data byte c has been stored at RNEXT-1: check header, fold checksum,
+// finish frame
+static inline void rx_byte (t_line* line, uc c)
+{
+    t_frame* rfr = &(line->rfr);
+    t_size p = RNEXT - 1;
+    t_cksum ck;
+
+    if (p < MESSAGE - 1) {
+        // leading byte of multibyte last index
+        rfr->cs = CK_STEP(rfr->cs, c);
+        return;
+    }
+
+    if (p == MESSAGE - 1) {
+        // header complete
+        rfr->cs = CK_STEP(rfr->cs, c);
+        if (RFRLAST >= MAXFRAMESIZE || RFRLAST < MESSAGE + CKSIZE) {
+            err("invalid checksum position, frame skipped\n");
+            rx_done (line, FRBADFMT);
+            RNEXT = SIGNATURE;
+        }
+        return;
+    }
+
+    if (p < CKNDX(RDATA)) {
+        // plain message char
+        rfr->cs = CK_STEP(rfr->cs, c);
+        return;
+    }
+
+    if (p == RFRLAST) {
+        // last char of checksum
+        ck = get_ck (RDATA + CKNDX(RDATA));
+        if ((t_cksum)CK_FINAL(rfr->cs) != ck) {
+            err("checksum in frame (0x%lx) doesn't match calculated (0x%lx), frame skipped\n",
+                    (unsigned long)ck, (unsigned long)(t_cksum)CK_FINAL(rfr->cs));
+            rx_done (line, FRBADSUM);
+        } else {
+            // transfer frame ownership to user code
+            rx_done (line, FROK);
+        }
+        RNEXT = SIGNATURE;
+    }
+    // else leading char of multibyte checksum
+}
+
+
+// checksum is folded in rfr->cs as bytes arrive,
+// so the frame is not scanned again when it ends.
+// 0xBA is stored at once, but interpreted only when the next char
+// tells whether it is doubled (data) or single (delimiter of next frame),
+// so it may be any byte after the signature, including header and checksum.
+// in MCU, line is the global one.
+static inline void rx_char (t_line* line, uc c)
 {
-    // TODO: first test for delimiter/double delimiter, to allow 0xBA as opcode
     // TODO: separate header and footer from frame.data
     // TODO: two-byte delimiter, as in SLIP.
     //
     t_frame* rfr = &(line->rfr); // TODO: get rid of this
-    uc checksum;
     //wrn("RNEXT %hhu c 0x%hhx\n", RNEXT, c);
 
     if (RNEXT == SIGNATURE) {
         if (c == FRAMEDELIMITER) {
             RDATA[RNEXT] = c;
             RNEXT++;
+            rfr->cs = CK_INIT;
+            LAT(line->lat.rx_first = lat_now ());
             //wrn("perhaps new frame\n");
-            return;
         } else {
             wrn("garbage: 0x%hhx\n", c);
-            return;
+            ST(line->stats.rx_garbage++);
         }
         return;
     }
 
-    if (RNEXT == LASTNDX) {
-       if (c == FRAMEDELIMITER) {
-            // TODO!
-            wrn("bug: frame size == frame delimiter, can't cope with this, assuming garbage\n");
-            RNEXT=SIGNATURE;
+    if (RFLAGS & HFDFL) {
+        RFLAGS &= ~HFDFL;
+        if (c == FRAMEDELIMITER) {
+            //wrn("skipping extra 0x%hhX\n", FRAMEDELIMITER);
+            rx_byte (line, c);
             return;
-        } else {
-            //wrn("checksum at position 0x%hhx\n", c);
-            if (c >= MAXFRAMESIZE) {
-                err("invalid checksum position, frame skipped\n");
-                rfr->flags |= READY;
-                X_DONE(cb_frame_rx_done, FRBADFMT);
-                RNEXT=SIGNATURE;
-                return;
-            } else {
-                RDATA[RNEXT] = c;
-                RNEXT++;
-                return;
-            }
         }
-       return;
-    } // lastndx
-
-    if (RNEXT == MESSAGE) {
-        RDATA[RNEXT] = c;
-        RNEXT++;
-        return;
-    } // message[0]
-
-    // all below for RNEXT > MESSAGE
+        wrn("single 0x%hhX in the middle of frame, resetting frame\n", FRAMEDELIMITER);
+        ST(line->stats.rx_resync++);
+        rx_done (line, FRBADFMT);
+        // it was the signature of a new frame, c goes to its header
+        RDATA[SIGNATURE] = FRAMEDELIMITER;
+        RNEXT = SIGNATURE+1;
+        rfr->cs = CK_INIT;
+        LAT(line->lat.rx_first = lat_now ());
+    }
 
     if (RNEXT >= MAXFRAMESIZE) {
         err("incoming frame buffer overrun\n");
-        rfr->flags |= READY;
-        X_DONE(cb_frame_rx_done, FRTOOLONG);
+        rx_done (line, FRTOOLONG);
         RNEXT = SIGNATURE;
         return;
     }
-    
-    if (c == FRAMEDELIMITER) {
-        // BA!
-        if (rfr->flags & HFDFL) {
-            //wrn("skipping extra 0x%hhX\n", FRAMEDELIMITER);
-            rfr->flags &= ~HFDFL;
-            return;
-        } else {
-            RDATA[RNEXT] = c;
-            RNEXT++;
-            rfr->flags |= HFDFL;
-            return;
-        }
-        return;
-    }
-           
-    if (rfr->flags & HFDFL) {
-        wrn("single 0x%hhX in the middle of frame, resetting frame\n", FRAMEDELIMITER);
-        rfr->flags |= READY;
-        X_DONE(cb_frame_rx_done, FRBADFMT);
-        RDATA[SIGNATURE] = FRAMEDELIMITER;
-        RDATA[SIGNATURE+1] = c;
-        RNEXT = SIGNATURE+2;
-        RFLAGS &= ~HFDFL;
-        return;
-    }
 
     RDATA[RNEXT] = c;
     RNEXT++;
-
-    if (RNEXT == (RFRLAST + 1)) {
-        // last char, the checksum
-        checksum = compute_checksum (rfr);
-        if (checksum != c) {
-            err("checksum in frame (0x%hhx) doesn't match calculated (0x%hhx), frame skipped\n", c, checksum);
-            rfr->flags |= READY;
-            X_DONE(cb_frame_rx_done, FRBADSUM);
-            RNEXT = SIGNATURE;
-            return;
-        } else {
-            // transfer frame ownership to user code
-            rfr->flags |= READY;
-            X_DONE(cb_frame_rx_done, FROK);
-            RNEXT = SIGNATURE;
-            return;
-        }
+    if (c == FRAMEDELIMITER) {
+        // BA! wait for the next char
+        RFLAGS |= HFDFL;
         return;
     }
+    rx_byte (line, c);
+
+} // rx_char
 
-    // plain msg[1+], not last, redundant
-    return;
 
-} // incoming_char
+#ifdef MCU
+void incoming_char (uc c)
+#else
+void incoming_char (t_line* line, uc c)
+#endif
+{
+    ST(line->stats.rx_bytes++);
+    rx_char (line, c);
+}
+
+
+// decode a chunk of wire bytes, calling cb_frame_rx_done for every frame.
+// results are the same as of incoming_char() for each byte,
+// but runs of message bytes are copied at once.
+// stops early if user code holds rx frame (READY) after callback;
+// returns number of bytes consumed.
+#ifdef MCU
+int incoming_chars (uc* buf, int len)
+#else
+int incoming_chars (t_line* line, uc* buf, int len)
+#endif
+{
+    t_frame* rfr = &(line->rfr);
+    int i, run;
+    uc* p;
+    uc* d;
+
+    i = 0;
+    while (i < len && !(RFLAGS & READY)) {
+        if (RNEXT >= MESSAGE && !(RFLAGS & HFDFL)) {
+            // message up to checksum or buffer end, whichever first.
+            // header is checked by now, so lastndx is in range
+            run = CKNDX(RDATA) - RNEXT;
+            if (run > len - i)
+                run = len - i;
+            if (run > 0) {
+                p = buf + i;
+                d = memchr (p, FRAMEDELIMITER, run);
+                if (d)
+                    run = d - p;
+                memcpy (RDATA + RNEXT, p, run);
+                rfr->cs = CK_BLOCK(rfr->cs, p, run);
+                RNEXT += run;
+                i += run;
+                if (i == len)
+                    break;
+            }
+        }
+        // header, delimiters, checksum and errors
+        rx_char (line, buf[i++]);
+    }
+    ST(line->stats.rx_bytes += i);
+    return i;
+}
 
 
 #ifdef MCU
@@ -205,6 +914,7 @@ uc outgoing_char (t_line* line)
         } else {
             // sending half delimiter
             LWFLAGS |= HFDFL;
+            ST(line->stats.tx_stuffed++);
             return FRAMEDELIMITER;
         }
     }
@@ -213,33 +923,205 @@ uc outgoing_char (t_line* line)
 
 
 #ifndef MCU
-int async_machine (t_line* line)
+// decode buffered chars until the buffer is empty
+// or user code holds rx frame (READY)
+void line_rx_drain (t_line* line)
+{
+    if (line->rxpos < line->rxlen)
+        line->rxpos += incoming_chars (line, line->rxbuf + line->rxpos,
+                line->rxlen - line->rxpos);
+}
+
+
+// read a chunk and decode it. call when fd is readable and rx frame 
+// is not held by user code, so the buffer is empty.
+// returns -1 on error, 0 on end of file, positive number otherwise
+int line_rx (t_line* line)
+{
+    int rdlen;
+    rdlen = read (LFD, line->rxbuf, RXCHUNK);
+    if (rdlen > 0) {
+        if (line->tap)
+            tap_record (line->tap, line, TAP_RX, line->rxbuf, rdlen);
+        line->rxpos = 0;
+        line->rxlen = rdlen;
+        line_rx_drain (line);  // generally, drop c in RDATA[NEXT++]
+    } else if (rdlen < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 1; // spurious wakeup, nothing lost
+        perror("should not happen - select() mistake? read()");
+    }
+    return rdlen;
+}
+
+
+// TXFRAME mode: write as much of stuffed wfr as the fd accepts.
+// returns 0 on success, including partial write, -1 on error
+static int tx_frame (t_line* line)
+{
+    int wrlen;
+    if (line->txlen == 0) {
+        // new frame
+        line->txlen = stuff_frame (LWFR, line->txbuf);
+        line->txpos = 0;
+        LAT(lat_tx_start (line));
+    }
+    wrlen = write (LFD, line->txbuf + line->txpos, line->txlen - line->txpos);
+    if (wrlen < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0; // retry when fd is writable again
+        perror("write()");
+        return -1;
+    }
+    if (line->tap)
+        tap_record (line->tap, line, TAP_TX, line->txbuf + line->txpos, wrlen);
+    line->txpos += wrlen;
+    ST(line->stats.tx_bytes += wrlen);
+    if (line->txpos < line->txlen)
+        return 0; // partial write
+    if (LFLAGS & TXDRAIN)
+        tcdrain (LFD);
+    // frame transmitted (or queued in kernel)
+    LAT(lat_tx_end (line));
+    ST(line->stats.tx_frames++);
+    ST(line->stats.tx_payload += MSGLEN(LWDATA));
+    ST(line->stats.tx_stuffed += line->txlen - (LWLAST + 1));
+    line->txlen = 0;
+    LWFLAGS &= ~READY;
+    X_DONE(cb_frame_tx_done, FROK);
+    LWNEXT = SIGNATURE;
+#if TXQLEN > 0
+    txq_next (line);
+#endif
+#if SUBMITQLEN > 0
+    submitq_next (line);
+#endif
+    return 0;
+}
+
+
+// byte-at-a-time mode: write next char and wait for it to go out.
+// returns 0 on success, -1 on error
+static int tx_char (t_line* line)
 {
     uc c;
+    int wrlen;
+    t_frame* wfr = &(line->wfr);
+
+    if (WNEXT > WFRLAST)
+        return 0;
+    //wrn("select: tx pos %d (fr ptr %p, 0x%hhx)\n", WNEXT, wfr, WDATA[WNEXT]);
+    LAT(if (WNEXT == SIGNATURE) lat_tx_start (line));
+    c = outgoing_char (line);  // generally, WDATA[WNEXT++]
+    //wrn("write WNEXT %hhu c 0x%hhx\n", WNEXT, c);
+    wrlen = write (LFD, &c, 1);
+    tcdrain (LFD);   // delay for output
+    if (wrlen != 1) {
+        perror("should not happen - select() mistake? write()");
+        return -1;
+    }
+    if (line->tap)
+        tap_record (line->tap, line, TAP_TX, &c, 1);
+    ST(line->stats.tx_bytes++);
+    if (WNEXT > WFRLAST) {
+        // frame transmitted
+        LAT(lat_tx_end (line));
+        ST(line->stats.tx_frames++);
+        ST(line->stats.tx_payload += MSGLEN(WDATA));
+        WFLAGS &= ~READY;
+        X_DONE(cb_frame_tx_done, FROK);
+        WNEXT = SIGNATURE; // unify with MCU code
+#if TXQLEN > 0
+        txq_next (line);
+#endif
+#if SUBMITQLEN > 0
+        submitq_next (line);
+#endif
+    }
+    return 0;
+}
+
+
+// call when fd is writable and tx frame is READY.
+// returns 0 on success, -1 on error
+int line_tx (t_line* line)
+{
+    if (LFLAGS & TXFRAME)
+        return tx_frame (line);
+    return tx_char (line);
+}
+
+
+static double mono ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+int async_machine (t_line* line)
+{
     fd_set rfds, wfds;
     struct timeval tv;
-    int selret;
-    int rdlen, wrlen;
+    int selret, nfds;
     bool exitrq;
     // before first cb_idle(), select() will return 
     // immediately if no IO available
     float timeout = 0;
+    // with timers, select() may time out before cb_idle() is due
+    double wait, next = INFINITY, idle_at = 0;
     DEFINE_FRAME_VIA_LINE
 
     do {
+        // timers first, their callbacks may fill wfr
+        if (line->timers) {
+            next = wheel_run (line->timers);
+            // or ask to exit, don't wait for select() then
+            if ((line->lflags) & EXIT_A_M) {
+                line->lflags &= ~EXIT_A_M;
+                break;
+            }
+        }
+        // leftover of previous chunk, if user code released rx frame
+        line_rx_drain (line);
+#if TXQLEN > 0
+        // frames queued outside of tx callback
+        txq_next (line);
+#endif
         FD_ZERO (&rfds);
         FD_ZERO (&wfds);
+        nfds = LFD + 1;
+#if SUBMITQLEN > 0
+        // frames of other threads; wakes us up if wfr is free
+        submitq_next (line);
+        FD_SET (line->sqfd, &rfds);
+        if (line->sqfd >= nfds)
+            nfds = line->sqfd + 1;
+#endif
         if (! (RFLAGS & READY)) {
             FD_SET (LFD, &rfds);
         }
         if (WFLAGS & READY) {
             FD_SET (LFD, &wfds);
         }
-        tv.tv_sec = (int)timeout;
-        tv.tv_usec = (timeout-tv.tv_sec)*1e6;
+        wait = timeout;
+        if (line->timers) {
+            wait = idle_at - mono ();
+            if (wait < 0)
+                wait = 0;
+            if (next < wait)
+                wait = next;
+        }
+        tv.tv_sec = (int)wait;
+        tv.tv_usec = (wait-tv.tv_sec)*1e6;
         selret = select (
-                LFD+1, 
+                nfds, 
+#if SUBMITQLEN > 0
+                &rfds,
+#else
                 (RFLAGS & READY) ? NULL : &rfds, 
+#endif
                 (WFLAGS & READY) ? &wfds : NULL, 
                 NULL, &tv);
         //wrn("select ret %d\n", selret);
@@ -254,38 +1136,29 @@ int async_machine (t_line* line)
 
             if ((!(RFLAGS & READY)) && FD_ISSET (LFD, &rfds)) {
                 //wrn("select: rx\n");
-                rdlen = read (LFD, &c, 1);
-                if (rdlen > 0) {
-                    incoming_char (line, c);  // generally, drop c in RDATA[NEXT++]
-                } else if (rdlen < 0) {
-                    perror("should not happen - select() mistake? read()");
+                if (line_rx (line) < 0)
                     return errno;
-                }
             }
 
-            if ((WFLAGS & READY) && (WNEXT <= WFRLAST) && FD_ISSET (LFD, &wfds)) {
-                //wrn("select: tx pos %d (fr ptr %p, 0x%hhx)\n", WNEXT, wfr, WDATA[WNEXT]);
-                c = outgoing_char (line);  // generally, WDATA[WNEXT++]
-                //wrn("write WNEXT %hhu c 0x%hhx\n", WNEXT, c);
-                wrlen = write (LFD, &c, 1);
-                tcdrain (LFD);   // delay for output
-                if (wrlen != 1) {
-                    perror("should not happen - select() mistake? write()");
+            if ((WFLAGS & READY) && FD_ISSET (LFD, &wfds)) {
+                if (line_tx (line))
                     return errno;
-                }
-                if (WNEXT > WFRLAST) {
-                    // frame transmitted
-                    WFLAGS &= ~READY;
-                    X_DONE(cb_frame_tx_done, FROK);
-                    WNEXT = SIGNATURE; // unify with MCU code
-                }
             }
 
+#if SUBMITQLEN > 0
+            if (FD_ISSET (line->sqfd, &rfds))
+                submitq_clear (line);
+#endif
+
+            if (line->timers)
+                idle_at = mono () + timeout;
         }
 
-        else {
+        else if (!line->timers || mono () >= idle_at) {
             //wrn("select: no data within timeout\n");
-            timeout = cb_idle (line); // to use in next select()
+            timeout = X_IDLE(line); // to use in next select()
+            if (line->timers)
+                idle_at = mono () + timeout;
         }
 
         exitrq = (line->lflags) & EXIT_A_M;
@@ -10,6 +10,7 @@
 #define LIBTRIVDL_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <errno.h>
 #ifndef MCU
@@ -26,6 +27,10 @@
 #include <fcntl.h>
 #endif
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #ifdef MCU
 #define msg(...) do {} while(0)
 #define wrn(...) do {} while(0)
@@ -40,14 +45,118 @@
 #endif
 #endif
 
+// LONGFRAMES: 16-bit last index (little endian) instead of 8-bit,
+// so frames may exceed 255 bytes. both ends must agree.
+#ifdef LONGFRAMES
+#define LENSIZE         2
+typedef uint16_t t_size;
+#else
+#define LENSIZE         1
+typedef unsigned char t_size;
+#endif
+
 // maximum frame size. think about:
 //   rx/tx error rate,
 //   MCU RAM limit,
-//   uchar limit 255,
+//   uchar limit 255 (use LONGFRAMES above it),
 //   race conditions in my bad MCU code
+#ifndef MAXFRAMESIZE
+#ifdef LONGFRAMES
+#define MAXFRAMESIZE    4096
+#else
 #define MAXFRAMESIZE    64
-#define OVERHEAD        3    // header + footer
-#define MINFRAMESIZE    4    // OVERHEAD + 1 char
+#endif
+#endif
+// last index and next must fit in t_size
+#if !defined(LONGFRAMES) && MAXFRAMESIZE > 255
+#error "MAXFRAMESIZE above 255 needs LONGFRAMES"
+#endif
+#if MAXFRAMESIZE > 65535
+#error "MAXFRAMESIZE must be 65535 at most"
+#endif
+
+// CHECKSUM: integrity check at the end of frame, both ends must agree.
+#define CK_SUM          0   // 8-bit additive sum (default)
+#define CK_CRC16        1   // CRC-16/CCITT-FALSE: poly 0x1021, init 0xFFFF
+#define CK_CRC32C       2   // CRC-32C (Castagnoli), crc32 instruction with SSE4.2
+#ifndef CHECKSUM
+#define CHECKSUM        CK_SUM
+#endif
+#if CHECKSUM == CK_CRC32C
+#define CKSIZE          4
+typedef uint32_t t_cksum;
+#elif CHECKSUM == CK_CRC16
+#define CKSIZE          2
+typedef uint16_t t_cksum;
+#else
+#define CKSIZE          1
+typedef uint8_t t_cksum;
+#endif
+
+#define OVERHEAD        (1+LENSIZE+CKSIZE)  // header + footer
+#define MINFRAMESIZE    (OVERHEAD+1)    // OVERHEAD + 1 char
+#define MAXMSG          (MAXFRAMESIZE-OVERHEAD) // longest message
+// frame on the wire: signature + every other byte possibly doubled
+#define MAXWIRESIZE     (2*MAXFRAMESIZE)
+
+#ifndef MCU
+// async machine reads up to RXCHUNK bytes per read() call.
+// USB-serial adapters typically deliver bursts of 64.
+#ifndef RXCHUNK
+#define RXCHUNK         64
+#endif
+#endif
+
+// TX queue: frames waiting for wfr, see send_frame().
+// MCU RAM is scarce, so there it is off unless defined. 128 at most
+#ifndef TXQLEN
+#ifdef MCU
+#define TXQLEN          0
+#else
+#define TXQLEN          8
+#endif
+#endif
+// head + count of the queue must fit in uc
+#if TXQLEN > 128
+#error "TXQLEN must be 128 at most"
+#endif
+
+// RX queue: received frames waiting for user code, see rxq_get().
+// 0 (default) means rx frame is held by user code until it clears READY.
+// must be below 128
+#ifndef RXQLEN
+#define RXQLEN          0
+#endif
+#if RXQLEN >= 128
+#error "RXQLEN must be below 128"
+#endif
+
+// SUBMITQLEN: lock-free queue for frames submitted from other threads,
+// see submit_frame(). 0 (default) means off, else a power of two.
+// POSIX only, in MCU it is always off.
+#if !defined(SUBMITQLEN) || defined(MCU)
+#undef SUBMITQLEN
+#define SUBMITQLEN      0
+#endif
+#if SUBMITQLEN & (SUBMITQLEN - 1)
+#error "SUBMITQLEN must be a power of two"
+#endif
+
+// STATS: per-line counters, see t_stats and line_stats().
+// MCU RAM is scarce, so there it is off unless defined.
+#ifndef STATS
+#ifdef MCU
+#define STATS           0
+#else
+#define STATS           1
+#endif
+#endif
+
+// LATENCY: per-line timestamps and latency histograms, see t_latency.
+// POSIX only, in MCU it is always off.
+#ifdef MCU
+#undef LATENCY
+#endif
 
 // special data values
 #define FRAMEDELIMITER  0xBA
@@ -55,7 +164,20 @@
 // t_frame character index
 #define SIGNATURE   0    // single FRAMEDELIMITER
 #define LASTNDX     1    // index of last character, where checksum resides
-#define MESSAGE     2    // first char of message
+#define MESSAGE     (LASTNDX+LENSIZE)    // first char of message
+// first char of checksum (little endian), it ends at last index
+#define CKNDX(d)    (GETLAST(d) + 1 - CKSIZE)
+// message length
+#define MSGLEN(d)   (CKNDX(d) - MESSAGE)
+
+// last index access
+#ifdef LONGFRAMES
+#define GETLAST(d)      ((t_size)((d)[LASTNDX] | ((d)[LASTNDX+1] << 8)))
+#define SETLAST(d,v)    do { (d)[LASTNDX] = (uc)(v); (d)[LASTNDX+1] = (uc)((v) >> 8); } while (0)
+#else
+#define GETLAST(d)      ((d)[LASTNDX])
+#define SETLAST(d,v)    ((d)[LASTNDX] = (v))
+#endif
 
 // frame flags
 #define READY       1   // tx: data ready to send, rx: read complete/data ready
@@ -68,12 +190,16 @@
 
 // line flags
 #define EXIT_A_M    4   // request to exit async machine
+#define TXFRAME     8   // async machine writes whole stuffed frame at once
+#define TXDRAIN     16  // with TXFRAME: wait for output (tcdrain) before cb_frame_tx_done
+#define INREACTOR   32  // line is registered in a reactor
 
 // frame return status, see cb_frame_ callbacks and strfrret
 #define FROK        0
 #define FRBADFMT    1   // malformed
 #define FRBADSUM    2   // checksum mismatch
 #define FRTOOLONG   3   // frame too long
+#define NFRSTATUS   4
 
 // shortcuts
 #define DATA        (fr->data)
@@ -83,16 +209,18 @@
 #define RNEXT       (rfr->next)
 #define RFLAGS      (rfr->flags)
 #define WFLAGS      (wfr->flags)
-#define FRLAST      (DATA[LASTNDX])
-#define WFRLAST     (WDATA[LASTNDX])
-#define RFRLAST     (RDATA[LASTNDX])
+#define FRLAST      GETLAST(DATA)
+#define WFRLAST     GETLAST(WDATA)
+#define RFRLAST     GETLAST(RDATA)
 #define LFD         (line->fd)
 #define LFLAGS      (line->lflags)
 #define LUSERDATA   (line->userdata)
 #define LRMSG       (line->rfr).data[MESSAGE]
 #define LWMSG       (line->wfr).data[MESSAGE]
-#define LRLAST      (line->rfr).data[LASTNDX]
-#define LWLAST      (line->wfr).data[LASTNDX]
+#define LRLAST      GETLAST((line->rfr).data)
+#define LWLAST      GETLAST((line->wfr).data)
+#define LRMSGLEN    MSGLEN((line->rfr).data)
+#define LWMSGLEN    MSGLEN((line->wfr).data)
 #define LRFLAGS     (line->rfr).flags
 #define LWFLAGS     (line->wfr).flags
 #define LRFR        &(line->rfr)
@@ -112,54 +240,226 @@
 typedef unsigned char uc;
 typedef struct {
     uc data[MAXFRAMESIZE];
-    uc next;
+    t_size next;
     uc flags;
+    t_cksum cs; // rx: running checksum of data[LASTNDX..next-1]
+#ifdef LATENCY
+    uint64_t built;     // tx: when checksum was added (build_frame), ns
+#endif
 } t_frame;
 
+#if STATS
+typedef struct {
+    unsigned long rx_bytes;     // from wire, delimiters and garbage included
+    unsigned long rx_frames[NFRSTATUS]; // by status: FROK, FRBADFMT, ...
+    unsigned long rx_payload;   // message bytes of FROK frames
+    unsigned long rx_garbage;   // bytes skipped while looking for frame
+    unsigned long rx_resync;    // frames cut by single 0xBA (FRBADFMT too)
+    unsigned long tx_bytes;     // to wire
+    unsigned long tx_frames;
+    unsigned long tx_payload;   // message bytes
+    unsigned long tx_stuffed;   // 0xBA added by byte stuffing
+} t_stats;
+#endif
+
+#ifdef LATENCY
+// log-bucket histogram of nanoseconds: 2^LAT_SUBBITS linear buckets
+// per power of two, i.e. 12.5% precision, up to 2^40 ns (18 min)
+#define LAT_SUBBITS     3
+#define LAT_BUCKETS     ((40 - LAT_SUBBITS + 1) << LAT_SUBBITS)
 typedef struct {
+    uint32_t count[LAT_BUCKETS];
+    uint64_t total;     // samples
+    uint64_t max;       // exact maximum, ns
+} t_hist;
+
+// timestamps (ns, CLOCK_MONOTONIC) of the last frame in each direction
+typedef struct {
+    uint64_t tx_first, tx_last;    // wfr: first and last byte written
+    uint64_t rx_first, rx_done;    // rfr: signature received, frame decoded
+    t_hist queue;   // built -> first byte written
+    t_hist tx;      // first -> last byte written (drained with TXDRAIN)
+    t_hist rx;      // signature -> frame decoded, FROK only
+} t_latency;
+#endif
+
+#ifndef MCU
+struct s_line;
+// per-line callbacks, see below.
+// with STATIC_CALLBACKS defined (both for library and user code) 
+// the global functions are called instead.
+typedef struct {
+    void (*cb_frame_rx_done) (uc status, struct s_line* line);
+    void (*cb_frame_tx_done) (uc status, struct s_line* line);
+    float (*cb_idle) (struct s_line* line);
+} t_callbacks;
+#endif
+
+typedef struct s_line {
 #ifndef MCU
     int fd;
+#ifndef STATIC_CALLBACKS
+    const t_callbacks* cb;
+#endif
+    uc rxbuf[RXCHUNK];  // received chunk, rxbuf[rxpos..rxlen-1] not yet decoded
+    int rxpos, rxlen;
+    uc txbuf[MAXWIRESIZE]; // TXFRAME: stuffed wfr, txbuf[txpos..txlen-1] not yet written
+    int txpos, txlen;
+    // reactor bookkeeping, see reactor.h
+    unsigned events;    // epoll events watched
+    float idle_tmo;     // last value returned by cb_idle
+    double idle_at;     // when to call cb_idle if there is no I/O
+    struct s_wheel* timers; // run by the machine of the line, see timer.h
+    struct s_tap* tap;  // wire capture, see tap.h
 #endif
     t_frame wfr;
     t_frame rfr;
+#if TXQLEN > 0
+    t_frame txq[TXQLEN];    // txq[txqhead] is the next to go to wfr
+    uc txqhead, txqcount;
+    unsigned txqfull;       // failed send_frame()/txq_reserve() calls
+#endif
+#if SUBMITQLEN > 0
+    // bounded MPSC queue: any thread takes a slot at sqtail, the machine
+    // thread moves frames from sqhead to wfr. seq of a slot tells whose
+    // turn it is. sqfd is eventfd to wake the machine when sqwake is set
+    struct {
+        volatile uint32_t seq;
+        t_frame fr;
+    } sq[SUBMITQLEN];
+    volatile uint32_t sqtail;
+    uint32_t sqhead;
+    volatile int sqwake;    // machine may sleep with wfr free
+    int sqfd;
+    volatile unsigned sqfull;  // failed submit_frame() calls
+#endif
+#if RXQLEN > 0
+    t_frame rxq[RXQLEN];
+    uc rxqstatus[RXQLEN];   // cb_frame_rx_done status of each frame
+    volatile uc rxqhead, rxqtail;
+    volatile unsigned rxqover; // frames lost because queue was full
+#endif
+#if STATS
+    t_stats stats;
+#endif
+#ifdef LATENCY
+    t_latency lat;
+#endif
     uc lflags;
     void* userdata;
 } t_line;
 
 
 void init_frame (t_frame* fr);
+#ifdef MCU
 int init_line (t_line* line, char* portname, void* userdata);
-uc compute_checksum (t_frame* fr);
+#else
+int init_line (t_line* line, char* portname, void* userdata, const t_callbacks* cb);
+#endif
+t_cksum compute_checksum (t_frame* fr);  // of data[LASTNDX..CKNDX-1]
 void add_hdr_and_checksum (t_frame* fr);
-t_frame* build_frame (t_frame* fr, uc* src, uc size); // fr must be allocated
+t_frame* build_frame (t_frame* fr, uc* src, t_size size); // fr must be allocated
+// build frame in place: write up to MAXMSG bytes of message at
+// frame_payload(), then finalize_frame() with its size adds the header
+// and checksum. NULL if the message is too long
+uc* frame_payload (t_frame* fr);
+t_frame* finalize_frame (t_frame* fr, t_size size);
+// build frame of message gathered from n buffers, e.g. opcode, header, body
+typedef struct {
+    const void* base;
+    t_size len;
+} t_iovec;
+t_frame* build_framev (t_frame* fr, const t_iovec* iov, int n);
+int stuff_frame (t_frame* fr, uc* dst); // wire form of fr, dst must hold MAXWIRESIZE
+#if TXQLEN > 0
+// queue frame for transmission; 0 if queue is full or frame is too long
+int send_frame (t_line* line, uc* src, t_size size);
+// or build it in place: slot or NULL if full, then commit
+t_frame* txq_reserve (t_line* line);
+void txq_commit (t_line* line);
+// move next queued frame to wfr if it is free; 1 if done.
+// async machine calls it, MCU TX ISR must call it after cb_frame_tx_done
+int txq_next (t_line* line);
+#endif
+#if SUBMITQLEN > 0
+// thread-safe send_frame(): queue frame from any thread and wake
+// the async machine or reactor. 0 if queue is full or frame is too long.
+// frames queued with send_frame() go first
+int submit_frame (t_line* line, uc* src, t_size size);
+// move next submitted frame to wfr if it is free; 1 if done.
+// called by async machine and reactor, from the line's thread only
+int submitq_next (t_line* line);
+// read sqfd when it is readable
+void submitq_clear (t_line* line);
+#endif
+#if RXQLEN > 0
+// oldest received frame and its status (may be NULL), or NULL if none.
+// frame stays in the queue until rxq_release()
+t_frame* rxq_get (t_line* line, uc* status);
+void rxq_release (t_line* line);
+#endif
 
 #ifdef MCU
 // to save MCU stack, assume SINGLE line (UART)
 t_line *line; // allocate it!
 void incoming_char (uc c); // call from RX ISR
+int incoming_chars (uc* buf, int len); // e.g. from DMA buffer
 uc outgoing_char ();
 #else
 int async_machine (t_line* line);
+// steps of async machine, for other event loops (see reactor.h)
+int line_rx (t_line* line);         // fd readable and rx frame not READY
+int line_tx (t_line* line);         // fd writable and tx frame READY
+void line_rx_drain (t_line* line);  // decode what is left after user released rx frame
 void incoming_char (t_line* line, uc c);
+int incoming_chars (t_line* line, uc* buf, int len);
 uc outgoing_char (t_line* line);
 char* strfr (t_frame* fr);
 char* strfrret (uc status);
 #endif
 
+#if STATS
+// copy of line counters, optionally zeroing them.
+// counters are updated by async machine (or ISR) without locking,
+// so a snapshot taken meanwhile may be off by the frame in progress
+void line_stats (t_line* line, t_stats* st, bool reset);
+#endif
+
+#ifdef LATENCY
+uint64_t lat_now ();    // CLOCK_MONOTONIC, ns
+void lat_add (t_hist* h, uint64_t ns);
+// value (ns) at quantile q (0..1), e.g. 0.99; 0 if empty.
+// histograms may be read while async machine runs (from other thread,
+// samples being added meanwhile may be missed)
+uint64_t lat_quantile (const t_hist* h, double q);
+void lat_dump (FILE* f, const char* name, const t_hist* h);
+#endif
+
+// CRC of len bytes, continuing from crc (register value).
+// start with 0xFFFF / 0xFFFFFFFF; CRC-32C result is then inverted
+uint16_t crc16_update (uint16_t crc, const uc* buf, int len);
+uint32_t crc32c_update (uint32_t crc, const uc* buf, int len);
+
 // callbacks for async machine.
-// define them all in your source:
+// in MCU (and POSIX with STATIC_CALLBACKS), define them all in your source;
+// otherwise, pass functions with these prototypes to init_line() 
+// in t_callbacks, they may differ from line to line.
 
 #ifdef MCU
 // in MCU, keep them short because they are called from ISR
 void cb_frame_rx_done (uc status);
 //void cb_frame_tx_done (uc status);  for now, take care of TX yourself. TODO
 #define X_DONE(a,b)   a(b)
-#else
+#elif defined(STATIC_CALLBACKS)
 void cb_frame_rx_done (uc status, t_line* line);
 void cb_frame_tx_done (uc status, t_line* line);
 #define X_DONE(a,b)   a(b, line)
+#define X_IDLE(line)  cb_idle(line)
+#else
+#define X_DONE(a,b)   (line->cb->a)(b, line)
+#define X_IDLE(line)  (line->cb->cb_idle)(line)
 #endif
-#ifndef MCU
+#if !defined(MCU) && defined(STATIC_CALLBACKS)
 // Called by async machine when there is nothing to send or receive.
 // must return time in seconds before its next call.
 // This time may be relatively large (1 sec or more), because 
@@ -188,4 +488,8 @@ void DEBUG2
 #endif
 #endif
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,179 @@
+/*
+ * libtrivdl multiplexer implementation.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+// multiplexer needs per-line callbacks, mux.h refuses STATIC_CALLBACKS
+#ifndef STATIC_CALLBACKS
+
+#include "mux.h"
+
+static void mux_rx_done (uc status, t_line* line);
+static void mux_tx_done (uc status, t_line* line);
+static float mux_idle (t_line* line);
+static const t_callbacks mux_callbacks = { mux_rx_done, mux_tx_done, mux_idle };
+
+
+void init_mux (t_mux* m, t_line* line, const t_mux_callbacks* cb, void* userdata)
+{
+    int c;
+    memset (m, 0, sizeof(*m));
+    m->line = line;
+    m->cb = cb;
+    m->userdata = userdata;
+    m->txch = -1;
+    for (c = 0; c < MUX_MAXCH; c++)
+        m->ch[c].weight = 1;
+    line->cb = &mux_callbacks;
+    line->userdata = m;
+}
+
+
+int mux_channel (t_mux* m, int ch, int prio, int weight)
+{
+    if (ch < 0 || ch >= MUX_MAXCH || prio < 0 || prio > 255
+            || weight < 1 || weight > 255) {
+        err("mux: bad channel %d, priority %d or weight %d\n", ch, prio, weight);
+        return 0;
+    }
+    m->ch[ch].prio = prio;
+    m->ch[ch].weight = weight;
+    return 1;
+}
+
+
+int mux_pending (t_mux* m, int ch)
+{
+    return m->ch[ch].count;
+}
+
+
+// channel to send from: highest priority first, then deficit round robin
+static int mux_pick (t_mux* m)
+{
+    t_mux_channel* ch;
+    int best = -1, c;
+
+    for (c = 0; c < MUX_MAXCH; c++)
+        if (m->ch[c].count && (best < 0 || m->ch[c].prio < m->ch[best].prio))
+            best = c;
+    if (best < 0)
+        return -1;
+    // stays on a channel while its deficit covers the head frame;
+    // each channel gets weight quanta on its turn, so this ends
+    for (;;) {
+        ch = m->ch + m->rr;
+        if (ch->count && ch->prio == m->ch[best].prio
+                && ch->deficit >= ch->q[ch->head].len)
+            return m->rr;
+        if (!ch->count)
+            ch->deficit = 0; // no credit saved while idle
+        if (++m->rr == MUX_MAXCH)
+            m->rr = 0;
+        ch = m->ch + m->rr;
+        if (ch->count && ch->prio == m->ch[best].prio)
+            ch->deficit += ch->weight * MUX_QUANTUM;
+    }
+}
+
+
+// build next frame right in wfr when tx is free
+static void mux_pump (t_mux* m)
+{
+    t_line* line = m->line;
+    t_mux_channel* ch;
+    t_mux_msg* q;
+    uc* d = &LWMSG;
+    int c;
+
+    if (LWFLAGS & READY)
+        return;
+    c = mux_pick (m);
+    if (c < 0)
+        return;
+    ch = m->ch + c;
+    q = ch->q + ch->head;
+    d[0] = c;
+    memcpy (d + MUX_HDR, q->data, q->len);
+    ch->deficit -= q->len;
+    if (++ch->head == MUX_QLEN)
+        ch->head = 0;
+    ch->count--;
+    ch->sent++;
+    m->txch = c;
+    finalize_frame (LWFR, MUX_HDR + q->len);
+    LWNEXT = SIGNATURE;
+    LWFLAGS |= READY;
+}
+
+
+int mux_send (t_mux* m, int ch, uc* msg, int len)
+{
+    t_mux_channel* c;
+    t_mux_msg* q;
+    int slot;
+
+    if (ch < 0 || ch >= MUX_MAXCH || len > MUX_MAXMSG)
+        return 0;
+    c = m->ch + ch;
+    if (c->count == MUX_QLEN) {
+        c->full++;
+        return 0;
+    }
+    slot = c->head + c->count;
+    if (slot >= MUX_QLEN)
+        slot -= MUX_QLEN;
+    q = c->q + slot;
+    memcpy (q->data, msg, len);
+    q->len = len;
+    c->count++;
+    mux_pump (m);
+    return 1;
+}
+
+
+static void mux_tx_done (uc status, t_line* line)
+{
+    t_mux* m = line->userdata;
+    int c = m->txch;
+
+    (void)status;
+    // next frame first, so the line does not wait for user code
+    m->txch = -1;
+    mux_pump (m);
+    if (c >= 0 && m->cb->cb_msg_sent)
+        m->cb->cb_msg_sent (m, c);
+}
+
+
+static void mux_rx_done (uc status, t_line* line)
+{
+    t_mux* m = line->userdata;
+    uc* d = &LRMSG;
+    int n = LRMSGLEN - MUX_HDR;
+
+    if (status != FROK || n < 0 || d[0] >= MUX_MAXCH) {
+        m->bad++;
+    } else {
+        m->ch[d[0]].received++;
+        m->cb->cb_msg_rx (m, d[0], d + MUX_HDR, n);
+    }
+    LRFLAGS &= ~READY;
+    mux_pump (m); // user code may have sent
+}
+
+
+static float mux_idle (t_line* line)
+{
+    t_mux* m = line->userdata;
+    float tmo = 1.0;
+    if (m->cb->cb_idle)
+        tmo = m->cb->cb_idle (m);
+    mux_pump (m);
+    return tmo;
+}
+
+#endif
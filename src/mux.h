@@ -0,0 +1,94 @@
+/*
+ * libtrivdl multiplexer: logical channels over a line with priority
+ * scheduling, POSIX only.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+#ifndef MUX_H
+#define MUX_H
+
+#include "libtrivdl.h"
+
+#ifdef STATIC_CALLBACKS
+#error "mux.h needs per-line callbacks, build without STATIC_CALLBACKS"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// multiplexer takes the line over, as ARQ does.
+// message of each frame starts with channel number:
+//   channel  payload...
+// each channel has its own TX queue. when a frame is out, the next one
+// is taken from the highest priority channel with frames queued; channels
+// of the same priority share the line by weight (deficit round robin in
+// bytes). so an urgent frame waits for one frame at most, whatever
+// is queued in bulk channels.
+#define MUX_HDR     1
+#define MUX_MAXMSG  (MAXFRAMESIZE - OVERHEAD - MUX_HDR)
+
+#ifndef MUX_MAXCH
+#define MUX_MAXCH   8
+#endif
+// frames queued per channel
+#ifndef MUX_QLEN
+#define MUX_QLEN    4
+#endif
+// bytes per round for weight 1
+#define MUX_QUANTUM MUX_MAXMSG
+
+typedef struct {
+    uc data[MUX_MAXMSG];
+    t_size len;
+} t_mux_msg;
+
+typedef struct {
+    uc prio;            // 0 is the highest
+    uc weight;          // share among channels of the same priority
+    int deficit;        // bytes it may send in its current turn
+    t_mux_msg q[MUX_QLEN];
+    uc head, count;
+    // counters
+    unsigned long sent, received, full;
+} t_mux_channel;
+
+struct s_mux;
+typedef struct {
+    // message received on channel ch. msg is valid during the call
+    void (*cb_msg_rx) (struct s_mux* m, int ch, uc* msg, int len);
+    // frame of channel ch is out, so mux_send() has room (may be NULL)
+    void (*cb_msg_sent) (struct s_mux* m, int ch);
+    // line is quiet, as cb_idle (may be NULL: 1 s)
+    float (*cb_idle) (struct s_mux* m);
+} t_mux_callbacks;
+
+typedef struct s_mux {
+    t_line* line;
+    const t_mux_callbacks* cb;
+    void* userdata;
+    t_mux_channel ch[MUX_MAXCH];
+    uc rr;              // channel in its turn
+    int txch;           // channel of the frame in wfr, or -1
+    unsigned long bad;  // damaged frames or unknown channels
+} t_mux;
+
+// attach to initialized line (fd set, not running).
+// all channels are of priority 0, weight 1
+void init_mux (t_mux* m, t_line* line, const t_mux_callbacks* cb, void* userdata);
+// set priority and weight (at least 1) of channel. returns 1 on success
+int mux_channel (t_mux* m, int ch, int prio, int weight);
+// queue message (up to MUX_MAXMSG bytes) on channel; 0 if its queue is full.
+// from outside of line callbacks in a reactor, call reactor_update_line()
+int mux_send (t_mux* m, int ch, uc* msg, int len);
+// frames queued on channel
+int mux_pending (t_mux* m, int ch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
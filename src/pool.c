@@ -0,0 +1,207 @@
+/*
+ * libtrivdl pool implementation.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+#include "pool.h"
+#include <stdlib.h>
+
+// free block: next block of its list or chain;
+// head of a chain on shared list: next chain and chain length too
+#define NEXT(b)     (((void**)(b))[0])
+#define CHAIN(b)    (((void**)(b))[1])
+#define LEN(b)      (((size_t*)(b))[2])
+
+// free lists of a thread for one pool
+typedef struct {
+    unsigned gen;       // of the pool they belong to, else stale
+    void* cur;          // blocks to alloc from and free to
+    int ncur;           // up to POOL_BATCH
+    void* full;         // chain of POOL_BATCH blocks freed before, or NULL
+} t_tlists;
+
+static __thread t_tlists tl[POOL_MAX];
+static t_pool* pools[POOL_MAX];
+static unsigned generation;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// put chain of n blocks on shared list
+static void give_chain (t_pool* p, void* c, size_t n)
+{
+    LEN(c) = n;
+    pthread_mutex_lock (&p->lock);
+    CHAIN(c) = p->chains;
+    p->chains = c;
+    p->out -= n;
+    pthread_mutex_unlock (&p->lock);
+}
+
+
+// take a chain from shared list to t->cur; 0 if there is none
+static int take_chain (t_pool* p, t_tlists* t)
+{
+    void* c;
+
+    pthread_mutex_lock (&p->lock);
+    c = p->chains;
+    if (!c) {
+        p->fails++;
+        pthread_mutex_unlock (&p->lock);
+        return 0;
+    }
+    p->chains = CHAIN(c);
+    t->ncur = LEN(c);
+    p->out += t->ncur;
+    if (p->out > p->high)
+        p->high = p->out;
+    p->refills++;
+    pthread_mutex_unlock (&p->lock);
+    t->cur = c;
+    return 1;
+}
+
+
+// thread exits: give its blocks back
+static void thread_exit (void* arg)
+{
+    t_pool* p = arg;
+    t_tlists* t = tl + p->id;
+
+    if (t->gen != p->gen)
+        return;
+    if (t->ncur)
+        give_chain (p, t->cur, t->ncur);
+    if (t->full)
+        give_chain (p, t->full, POOL_BATCH);
+    t->gen = 0;
+}
+
+
+static inline t_tlists* lists (t_pool* p)
+{
+    t_tlists* t = tl + p->id;
+    if (t->gen != p->gen) {
+        // first use in this thread (or lists of a closed pool)
+        t->gen = p->gen;
+        t->cur = t->full = NULL;
+        t->ncur = 0;
+        pthread_setspecific (p->key, p);
+    }
+    return t;
+}
+
+
+int init_pool (t_pool* p, size_t size, size_t count)
+{
+    size_t i, k;
+    uc* b;
+
+    memset (p, 0, sizeof(*p));
+    if (size < 3 * sizeof(void*))
+        size = 3 * sizeof(void*); // room for NEXT, CHAIN, LEN
+    p->size = (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+    p->blocks = (count + POOL_BATCH - 1) / POOL_BATCH * POOL_BATCH;
+    pthread_mutex_lock (&pools_lock);
+    for (p->id = 0; p->id < POOL_MAX && pools[p->id]; p->id++)
+        ;
+    if (p->id == POOL_MAX) {
+        pthread_mutex_unlock (&pools_lock);
+        err("pool: more than %d pools\n", POOL_MAX);
+        return 0;
+    }
+    pools[p->id] = p;
+    p->gen = ++generation;
+    pthread_mutex_unlock (&pools_lock);
+    p->mem = aligned_alloc (POOL_ALIGN, p->size * p->blocks);
+    if (!p->mem || pthread_key_create (&p->key, thread_exit)) {
+        err("pool: cannot allocate %zu blocks of %zu bytes\n", p->blocks, p->size);
+        free (p->mem);
+        pthread_mutex_lock (&pools_lock);
+        pools[p->id] = NULL;
+        pthread_mutex_unlock (&pools_lock);
+        return 0;
+    }
+    // touch it all now, rather than fault pages in later
+    memset (p->mem, 0, p->size * p->blocks);
+    pthread_mutex_init (&p->lock, NULL);
+    for (i = p->blocks; i > 0; i -= POOL_BATCH) {
+        for (k = 0; k < POOL_BATCH; k++) {
+            b = p->mem + (i - POOL_BATCH + k) * p->size;
+            NEXT(b) = k < POOL_BATCH - 1 ? b + p->size : NULL;
+        }
+        b = p->mem + (i - POOL_BATCH) * p->size;
+        LEN(b) = POOL_BATCH;
+        CHAIN(b) = p->chains;
+        p->chains = b;
+    }
+    return 1;
+}
+
+
+void close_pool (t_pool* p)
+{
+    pthread_key_delete (p->key);
+    pthread_mutex_destroy (&p->lock);
+    free (p->mem);
+    p->mem = NULL;
+    pthread_mutex_lock (&pools_lock);
+    pools[p->id] = NULL;
+    pthread_mutex_unlock (&pools_lock);
+}
+
+
+void* pool_alloc (t_pool* p)
+{
+    t_tlists* t = lists (p);
+    void* b;
+
+    if (!t->cur) {
+        if (t->full) {
+            t->cur = t->full;
+            t->ncur = POOL_BATCH;
+            t->full = NULL;
+        } else if (!take_chain (p, t)) {
+            return NULL;
+        }
+    }
+    b = t->cur;
+    t->cur = NEXT(b);
+    t->ncur--;
+    return b;
+}
+
+
+void pool_free (t_pool* p, void* b)
+{
+    t_tlists* t = lists (p);
+
+    if (t->ncur == POOL_BATCH) {
+        if (t->full)
+            give_chain (p, t->full, POOL_BATCH);
+        t->full = t->cur;
+        t->cur = NULL;
+        t->ncur = 0;
+    }
+    NEXT(b) = t->cur;
+    t->cur = b;
+    t->ncur++;
+}
+
+
+void pool_stats (t_pool* p, t_pool_stats* st, bool reset)
+{
+    pthread_mutex_lock (&p->lock);
+    st->size = p->size;
+    st->blocks = p->blocks;
+    st->out = p->out;
+    st->high = p->high;
+    st->refills = p->refills;
+    st->fails = p->fails;
+    if (reset)
+        p->high = p->out;
+    pthread_mutex_unlock (&p->lock);
+}
@@ -0,0 +1,76 @@
+/*
+ * libtrivdl pool: fixed-size blocks for frames (and lines) made at run
+ * time, POSIX only.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include "libtrivdl.h"
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// a pool is allocated whole by init_pool() at startup, so frames of
+// application queues and lines plugged in at run time cost no heap.
+// the library does not allocate from it, t_line keeps its own queues:
+//   init_pool (&frames, sizeof(t_frame), 4096);
+//   t_frame* fr = pool_alloc (&frames);  // NULL if all are in use
+//   pool_free (&frames, fr);
+// blocks are cache-line (POOL_ALIGN) aligned and sized, so two never
+// share a line. alloc and free are O(1): each thread has free lists of
+// its own, and takes or gives back POOL_BATCH blocks at once from the
+// shared list, under lock, when it runs out or has too many.
+// any thread may free any block; a thread gives its blocks back when
+// it exits. a pool never grows, and pool_alloc() may fail while other
+// threads keep up to 2 * POOL_BATCH free blocks each: pool stats tell
+// how many blocks were needed at most
+#define POOL_ALIGN      64
+#ifndef POOL_BATCH
+#define POOL_BATCH      16
+#endif
+#define POOL_MAX        8   // pools at a time in a process
+
+typedef struct {
+    size_t size;        // block size
+    size_t blocks;      // in the pool
+    size_t out;         // not on shared list: in use or on thread lists
+    size_t high;        // most out at once: a pool this large would do
+    unsigned long refills;  // batches taken from shared list
+    unsigned long fails;    // pool_alloc() returned NULL
+} t_pool_stats;
+
+typedef struct s_pool {
+    int id;             // of thread lists
+    unsigned gen;       // tells lists of this pool from a closed one's
+    size_t size, blocks;
+    uc* mem;
+    pthread_key_t key;  // gives thread lists back on thread exit
+    pthread_mutex_t lock;
+    // under lock: chains of up to POOL_BATCH blocks, linked by their heads
+    void* chains;
+    size_t out, high;
+    unsigned long refills, fails;
+} t_pool;
+
+// blocks of size bytes, count is rounded up to POOL_BATCH.
+// returns 1 on success
+int init_pool (t_pool* p, size_t size, size_t count);
+// free pool memory; blocks must not be used any more
+void close_pool (t_pool* p);
+void* pool_alloc (t_pool* p);
+void pool_free (t_pool* p, void* b);
+// reset sets high to what is out now
+void pool_stats (t_pool* p, t_pool_stats* st, bool reset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,348 @@
+/*
+ * libtrivdl reactor implementation.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+#include "reactor.h"
+#include "timer.h"
+#include <stdlib.h>
+// INFINITY
+#include <math.h>
+// INT_MAX
+#include <limits.h>
+#include <time.h>
+
+
+static double mono ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+int init_reactor (t_reactor* r)
+{
+    r->epfd = epoll_create1 (EPOLL_CLOEXEC);
+    if (r->epfd < 0) {
+        err("epoll_create1: %s\n", strerror(errno));
+        return 0;
+    }
+    r->lines = NULL;
+    r->nlines = r->maxlines = 0;
+    r->idle_at = INFINITY;
+    r->rflags = 0;
+    r->wakefd = -1;
+    r->cb_wake = NULL;
+    r->cb_gone = NULL;
+    r->userdata = NULL;
+    r->ev = NULL;
+    r->nev = 0;
+    return 1;
+}
+
+
+int reactor_set_wakeup (t_reactor* r, int fd, void (*cb) (t_reactor* r))
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = r; // never a line
+    if (epoll_ctl (r->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        err("epoll_ctl: %s\n", strerror(errno));
+        return 0;
+    }
+    r->wakefd = fd;
+    r->cb_wake = cb;
+    return 1;
+}
+
+
+void close_reactor (t_reactor* r)
+{
+    close (r->epfd);
+    free (r->lines);
+    r->lines = NULL;
+    r->nlines = r->maxlines = 0;
+}
+
+
+// events the line is waiting for, same as async machine select()s
+static unsigned line_wants (t_line* line)
+{
+    return ((LRFLAGS & READY) ? 0 : EPOLLIN) | ((LWFLAGS & READY) ? EPOLLOUT : 0);
+}
+
+
+static void line_watch (t_reactor* r, t_line* line)
+{
+    struct epoll_event ev;
+    unsigned want = line_wants (line);
+    if (want == line->events)
+        return;
+    ev.events = want;
+    ev.data.ptr = line;
+    if (epoll_ctl (r->epfd, EPOLL_CTL_MOD, LFD, &ev) < 0) {
+        err("epoll_ctl: %s\n", strerror(errno));
+    }
+    line->events = want;
+}
+
+
+int reactor_add_line (t_reactor* r, t_line* line)
+{
+    struct epoll_event ev;
+    t_line** lines;
+
+    if (r->nlines == r->maxlines) {
+        lines = realloc (r->lines, (r->maxlines * 2 + 8) * sizeof(t_line*));
+        if (!lines) {
+            err("reactor: out of memory\n");
+            return 0;
+        }
+        r->lines = lines;
+        r->maxlines = r->maxlines * 2 + 8;
+    }
+#if TXQLEN > 0
+    txq_next (line);
+#endif
+    line->events = line_wants (line);
+    ev.events = line->events;
+    ev.data.ptr = line;
+    if (epoll_ctl (r->epfd, EPOLL_CTL_ADD, LFD, &ev) < 0) {
+        err("epoll_ctl: %s\n", strerror(errno));
+        return 0;
+    }
+#if SUBMITQLEN > 0
+    // eventfd events are told from line ones by the low bit
+    submitq_next (line);
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uintptr_t)line | 1;
+    if (epoll_ctl (r->epfd, EPOLL_CTL_ADD, line->sqfd, &ev) < 0) {
+        err("epoll_ctl: %s\n", strerror(errno));
+        epoll_ctl (r->epfd, EPOLL_CTL_DEL, LFD, NULL);
+        return 0;
+    }
+#endif
+    r->lines[r->nlines++] = line;
+    // as in async machine, first cb_idle() comes at once if there is no I/O
+    line->idle_tmo = 0;
+    line->idle_at = mono ();
+    if (line->idle_at < r->idle_at)
+        r->idle_at = line->idle_at;
+    LFLAGS |= INREACTOR;
+    return 1;
+}
+
+
+void reactor_del_line (t_reactor* r, t_line* line)
+{
+    int i;
+    if (!(LFLAGS & INREACTOR))
+        return;
+    epoll_ctl (r->epfd, EPOLL_CTL_DEL, LFD, NULL);
+#if SUBMITQLEN > 0
+    epoll_ctl (r->epfd, EPOLL_CTL_DEL, line->sqfd, NULL);
+#endif
+    for (i = 0; i < r->nlines; i++) {
+        if (r->lines[i] == line) {
+            r->lines[i] = r->lines[--r->nlines];
+            break;
+        }
+    }
+    // events of the line still to be handled in this batch
+    for (i = 0; i < r->nev; i++) {
+#if SUBMITQLEN > 0
+        if ((t_line*)(uintptr_t)(r->ev[i].data.u64 & ~(uint64_t)1) == line)
+#else
+        if (r->ev[i].data.ptr == line)
+#endif
+            r->ev[i].data.u64 = 0;
+    }
+    LFLAGS &= ~INREACTOR;
+}
+
+
+void reactor_update_line (t_reactor* r, t_line* line)
+{
+    double at;
+
+    if (!(LFLAGS & INREACTOR))
+        return;
+    // rx may have been released with bytes left in buffer,
+    // they won't wake up epoll
+    line_rx_drain (line);
+#if TXQLEN > 0
+    txq_next (line);
+#endif
+#if SUBMITQLEN > 0
+    submitq_next (line);
+#endif
+    line_watch (r, line);
+    // timers may have been started
+    if (line->timers) {
+        at = mono () + wheel_next (line->timers);
+        if (at < r->idle_at)
+            r->idle_at = at;
+    }
+}
+
+
+// reactor removes line by itself
+static void line_drop (t_reactor* r, t_line* line)
+{
+    if (!(LFLAGS & INREACTOR))
+        return;
+    reactor_del_line (r, line);
+    if (r->cb_gone)
+        r->cb_gone (r, line);
+}
+
+
+// after callbacks: exit request or new interest
+static void line_settle (t_reactor* r, t_line* line)
+{
+    if (LFLAGS & EXIT_A_M) {
+        LFLAGS &= ~EXIT_A_M;
+        line_drop (r, line);
+        return;
+    }
+    if (LFLAGS & INREACTOR)
+        reactor_update_line (r, line);
+}
+
+
+static void line_event (t_reactor* r, t_line* line, unsigned events, double now)
+{
+    int rc;
+
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        if (LRFLAGS & READY) {
+            // hangup while user holds rx frame
+            err("line %d: hangup\n", LFD);
+            line_drop (r, line);
+            return;
+        }
+        rc = line_rx (line);
+        if (rc <= 0) {
+            if (rc == 0) {
+                err("line %d: end of file\n", LFD);
+            }
+            line_drop (r, line);
+            return;
+        }
+    }
+    if ((events & EPOLLOUT) && (LWFLAGS & READY) && (LFLAGS & INREACTOR)) {
+        if (line_tx (line)) {
+            line_drop (r, line);
+            return;
+        }
+    }
+    // I/O happened, postpone cb_idle
+    line->idle_at = now + line->idle_tmo;
+    line_settle (r, line);
+}
+
+
+// fire timers that are due, and call cb_idle for lines without I/O
+// for their idle time
+static void reactor_idle (t_reactor* r, double now)
+{
+    int i;
+    t_line* line;
+    double at;
+
+    r->idle_at = INFINITY;
+    // backwards: removal moves the last line to the current slot
+    for (i = r->nlines - 1; i >= 0; i--) {
+        if (i >= r->nlines)
+            continue; // callback removed more than one line
+        line = r->lines[i];
+        if (line->timers) {
+            wheel_run (line->timers);
+            line_settle (r, line);
+            if (!(LFLAGS & INREACTOR))
+                continue;
+        }
+        if (line->idle_at <= now) {
+            line->idle_tmo = X_IDLE(line);
+            line->idle_at = now + line->idle_tmo;
+            line_settle (r, line);
+            if (!(LFLAGS & INREACTOR))
+                continue;
+        }
+        if (line->idle_at < r->idle_at)
+            r->idle_at = line->idle_at;
+        if (line->timers) {
+            at = now + wheel_next (line->timers);
+            if (at < r->idle_at)
+                r->idle_at = at;
+        }
+    }
+}
+
+
+int reactor_run (t_reactor* r)
+{
+    struct epoll_event ev[REACTOR_EVENTS];
+    int n, i, ms;
+    double now;
+    t_line* line;
+    bool woke;
+
+    r->rflags &= ~EXIT_A_M;
+    while ((r->nlines || r->cb_wake) && !(r->rflags & EXIT_A_M)) {
+        now = mono ();
+        if (now >= r->idle_at) {
+            reactor_idle (r, now);
+            continue;
+        }
+        if (isinf (r->idle_at))
+            ms = -1; // no lines
+        else if ((r->idle_at - now) * 1e3 >= INT_MAX - 1)
+            ms = INT_MAX; // huge cb_idle() value
+        else
+            ms = (int)((r->idle_at - now) * 1e3) + 1; // round up
+        n = epoll_wait (r->epfd, ev, REACTOR_EVENTS, ms);
+        woke = false;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait()");
+            return errno;
+        }
+        now = mono ();
+        r->ev = ev;
+        r->nev = n;
+        for (i = 0; i < n; i++) {
+            if (ev[i].data.ptr == r) {
+                woke = true;
+                continue;
+            }
+            // removed by callback of a line handled earlier in this batch
+            if (!ev[i].data.u64)
+                continue;
+#if SUBMITQLEN > 0
+            line = (t_line*)(uintptr_t)(ev[i].data.u64 & ~(uint64_t)1);
+#else
+            line = ev[i].data.ptr;
+#endif
+#if SUBMITQLEN > 0
+            if (ev[i].data.u64 & 1) {
+                // another thread submitted frames
+                submitq_clear (line);
+                reactor_update_line (r, line);
+                continue;
+            }
+#endif
+            line_event (r, line, ev[i].events, now);
+        }
+        r->nev = 0;
+        // after the batch, so that cb_wake may hand lines to other threads
+        if (woke)
+            r->cb_wake (r);
+    }
+    return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * libtrivdl reactor: async machine for many lines, POSIX only.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "libtrivdl.h"
+#include <sys/epoll.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// epoll events fetched per epoll_wait()
+#define REACTOR_EVENTS  64
+
+typedef struct s_reactor {
+    int epfd;
+    t_line** lines;     // registered lines, unordered
+    int nlines, maxlines;
+    double idle_at;     // earliest idle_at of lines, or later
+    uc rflags;          // EXIT_A_M
+    // wakeup fd, see reactor_set_wakeup()
+    int wakefd;
+    void (*cb_wake) (struct s_reactor* r);
+    // called when the reactor removes a line by itself (end of file,
+    // hangup, I/O error or EXIT_A_M in line flags), or NULL
+    void (*cb_gone) (struct s_reactor* r, t_line* line);
+    void* userdata;
+    // events of the batch being handled, see reactor_del_line()
+    struct epoll_event* ev;
+    int nev;
+} t_reactor;
+
+int init_reactor (t_reactor* r);
+void close_reactor (t_reactor* r); // lines are left open
+// register/unregister line at any time, including from callbacks.
+// events of the current batch for a removed line are dropped, so a line
+// removed from callbacks of another line may be freed right away. a line
+// removed from its own callbacks or timers is still looked at when they
+// return: free it later, e.g. from another line, cb_wake or after
+// reactor_run() returns
+int reactor_add_line (t_reactor* r, t_line* line);
+void reactor_del_line (t_reactor* r, t_line* line);
+// call after READY flags of a line were changed, or its timers were
+// started, outside of its own callbacks (e.g. from callback of another line)
+void reactor_update_line (t_reactor* r, t_line* line);
+// watch fd (e.g. eventfd) besides lines and call cb when it is readable,
+// after line events fetched with it. the reactor then keeps running
+// without lines too
+int reactor_set_wakeup (t_reactor* r, int fd, void (*cb) (t_reactor* r));
+// run until all lines are removed or EXIT_A_M is set in r->rflags.
+// EXIT_A_M in line flags removes that line. timers of lines
+// (line->timers, see timer.h) are run before waiting for events.
+int reactor_run (t_reactor* r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,365 @@
+/*
+ * libtrivdl shards implementation.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+// pthread_setaffinity_np
+#define _GNU_SOURCE
+#include "shard.h"
+#include <stdlib.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+
+// commands to worker
+#define CMD_ADD     1   // add line, or pass it on if it goes elsewhere now
+#define CMD_MOVE    2   // del line and pass it where it goes now
+#define CMD_STOP    3
+
+typedef struct s_shard_cmd {
+    uc op;
+    t_line* line;
+} t_shard_cmd;
+
+
+// append command to worker queue and wake it; under lock.
+// returns 0 if out of memory
+static int post (t_shards* s, int i, uc op, t_line* line)
+{
+    t_shard* w = s->w + i;
+    t_shard_cmd* cmds;
+    uint64_t one = 1;
+    int n;
+
+    if (w->ncmds == w->maxcmds) {
+        cmds = realloc (w->cmds, (w->maxcmds * 2 + 8) * sizeof(t_shard_cmd));
+        if (!cmds) {
+            err("shards: out of memory\n");
+            return 0;
+        }
+        w->cmds = cmds;
+        w->maxcmds = w->maxcmds * 2 + 8;
+    }
+    w->cmds[w->ncmds].op = op;
+    w->cmds[w->ncmds].line = line;
+    w->ncmds++;
+    if (w->ncmds == 1) {
+        n = write (w->evfd, &one, sizeof(one));
+        (void)n;
+    }
+    return 1;
+}
+
+
+// index of line in map, or -1; under lock
+static int find (t_shards* s, t_line* line)
+{
+    int i;
+    for (i = 0; i < s->nmap; i++)
+        if (s->map[i].line == line)
+            return i;
+    return -1;
+}
+
+
+// line is out of workers: forget it; under lock
+static void drop (t_shards* s, int i)
+{
+    s->map[i] = s->map[--s->nmap];
+    pthread_cond_broadcast (&s->cond);
+}
+
+
+// line arrived in worker w, or should leave it; under lock.
+// returns 1 if it stays, -1 if the reactor would not take it
+static int settle (t_shards* s, t_shard* w, t_line* line, uc op)
+{
+    int self = w - s->w;
+    int i = find (s, line);
+
+    if (i < 0)
+        return 0; // taken back by its worker
+    if (op == CMD_MOVE) {
+        s->map[i].moving = false;
+        if (s->map[i].shard == self)
+            return 0; // moved back before it left
+        reactor_del_line (&w->r, line);
+        s->map[i].at = -1;
+    } else if (s->map[i].shard == self) {
+        if (reactor_add_line (&w->r, line)) {
+            s->map[i].at = self;
+            return 1;
+        }
+        err("shards: worker %d cannot take line %d\n", self, LFD);
+        w->nlines--;
+        drop (s, i);
+        return -1;
+    }
+    if (s->map[i].shard < 0)
+        drop (s, i);
+    else
+        post (s, s->map[i].shard, CMD_ADD, line);
+    return 0;
+}
+
+
+// reactor removed line by itself (end of file, EXIT_A_M...): forget it
+static void shard_gone (t_reactor* r, t_line* line)
+{
+    t_shard* w = r->userdata;
+    t_shards* s = w->pool;
+    int i;
+
+    pthread_mutex_lock (&s->lock);
+    i = find (s, line);
+    if (i >= 0 && s->map[i].at == w - s->w) {
+        // a queued CMD_MOVE finds it gone and does nothing
+        if (s->map[i].shard >= 0)
+            s->w[s->map[i].shard].nlines--;
+        drop (s, i);
+    }
+    pthread_mutex_unlock (&s->lock);
+}
+
+
+// reactor wakeup: run queued commands, after events of the batch
+static void shard_wake (t_reactor* r)
+{
+    t_shard* w = r->userdata;
+    t_shards* s = w->pool;
+    t_shard_cmd* cmds;
+    uint64_t v;
+    int n, k, stays;
+
+    n = read (w->evfd, &v, sizeof(v));
+    (void)n;
+    // take the batch, so that callbacks may post commands
+    pthread_mutex_lock (&s->lock);
+    cmds = w->cmds;
+    n = w->ncmds;
+    w->cmds = NULL;
+    w->ncmds = w->maxcmds = 0;
+    pthread_mutex_unlock (&s->lock);
+
+    for (k = 0; k < n; k++) {
+        if (cmds[k].op == CMD_STOP) {
+            r->rflags |= EXIT_A_M;
+            continue;
+        }
+        pthread_mutex_lock (&s->lock);
+        stays = settle (s, w, cmds[k].line, cmds[k].op);
+        pthread_mutex_unlock (&s->lock);
+        // bytes left in rxbuf, with callbacks out of lock
+        if (stays > 0 && cmds[k].op == CMD_ADD)
+            reactor_update_line (r, cmds[k].line);
+        if (stays < 0 && s->cb_failed)
+            s->cb_failed (s, cmds[k].line);
+    }
+    free (cmds);
+}
+
+
+static void* shard_run (void* arg)
+{
+    t_shard* w = arg;
+    cpu_set_t set;
+
+    if (w->cpu >= 0) {
+        CPU_ZERO (&set);
+        CPU_SET (w->cpu, &set);
+        if (pthread_setaffinity_np (pthread_self (), sizeof(set), &set)) {
+            err("shards: cannot pin to cpu %d\n", w->cpu);
+        }
+    }
+    reactor_run (&w->r);
+    return NULL;
+}
+
+
+int init_shards (t_shards* s, int n, bool pin)
+{
+    long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+    t_shard* w;
+
+    if (cpus < 1)
+        cpus = 1;
+    if (n < 1)
+        n = cpus;
+    memset (s, 0, sizeof(*s));
+    s->w = calloc (n, sizeof(t_shard));
+    if (!s->w) {
+        err("shards: out of memory\n");
+        return 0;
+    }
+    pthread_mutex_init (&s->lock, NULL);
+    pthread_cond_init (&s->cond, NULL);
+    for (s->n = 0; s->n < n; s->n++) {
+        w = s->w + s->n;
+        w->pool = s;
+        w->cpu = pin ? s->n % cpus : -1;
+        w->evfd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (w->evfd < 0) {
+            err("eventfd: %s\n", strerror(errno));
+            break;
+        }
+        if (!init_reactor (&w->r)) {
+            close (w->evfd);
+            break;
+        }
+        w->r.userdata = w;
+        w->r.cb_gone = shard_gone;
+        if (!reactor_set_wakeup (&w->r, w->evfd, shard_wake)
+                || pthread_create (&w->th, NULL, shard_run, w)) {
+            err("shards: cannot start worker %d\n", s->n);
+            close_reactor (&w->r);
+            close (w->evfd);
+            break;
+        }
+    }
+    if (s->n < n) {
+        close_shards (s);
+        return 0;
+    }
+    return 1;
+}
+
+
+void close_shards (t_shards* s)
+{
+    int i;
+
+    pthread_mutex_lock (&s->lock);
+    for (i = 0; i < s->n; i++)
+        post (s, i, CMD_STOP, NULL);
+    pthread_mutex_unlock (&s->lock);
+    for (i = 0; i < s->n; i++) {
+        pthread_join (s->w[i].th, NULL);
+        close_reactor (&s->w[i].r);
+        close (s->w[i].evfd);
+        free (s->w[i].cmds);
+    }
+    pthread_cond_destroy (&s->cond);
+    pthread_mutex_destroy (&s->lock);
+    free (s->w);
+    free (s->map);
+    s->w = NULL;
+    s->map = NULL;
+    s->n = s->nmap = s->maxmap = 0;
+}
+
+
+int shards_add_line (t_shards* s, t_line* line, int shard)
+{
+    void* map;
+    int i;
+
+    pthread_mutex_lock (&s->lock);
+    if (find (s, line) >= 0 || shard >= s->n) {
+        err("shards: line %d is added already, or no worker %d\n", LFD, shard);
+        goto fail;
+    }
+    if (shard < 0) {
+        // least loaded
+        for (shard = 0, i = 1; i < s->n; i++)
+            if (s->w[i].nlines < s->w[shard].nlines)
+                shard = i;
+    }
+    if (s->nmap == s->maxmap) {
+        map = realloc (s->map, (s->maxmap * 2 + 8) * sizeof(*s->map));
+        if (!map) {
+            err("shards: out of memory\n");
+            goto fail;
+        }
+        s->map = map;
+        s->maxmap = s->maxmap * 2 + 8;
+    }
+    if (!post (s, shard, CMD_ADD, line))
+        goto fail;
+    i = s->nmap++;
+    s->map[i].line = line;
+    s->map[i].shard = shard;
+    s->map[i].at = -1;
+    s->map[i].moving = false;
+    s->w[shard].nlines++;
+    pthread_mutex_unlock (&s->lock);
+    return shard;
+fail:
+    pthread_mutex_unlock (&s->lock);
+    return -1;
+}
+
+
+// redirect line to shard (-1: take back) and tell its holder; under lock.
+// in transit, it is redirected when it arrives
+static int retarget (t_shards* s, int i, int shard)
+{
+    int at = s->map[i].at;
+
+    if (at >= 0 && at != shard && !s->map[i].moving) {
+        if (!post (s, at, CMD_MOVE, s->map[i].line))
+            return 0;
+        s->map[i].moving = true;
+    }
+    s->w[s->map[i].shard].nlines--;
+    if (shard >= 0)
+        s->w[shard].nlines++;
+    s->map[i].shard = shard;
+    return 1;
+}
+
+
+int shards_move_line (t_shards* s, t_line* line, int shard)
+{
+    int i, ok = 0;
+
+    pthread_mutex_lock (&s->lock);
+    i = find (s, line);
+    if (i >= 0 && s->map[i].shard >= 0 && shard >= 0 && shard < s->n)
+        ok = retarget (s, i, shard);
+    pthread_mutex_unlock (&s->lock);
+    return ok;
+}
+
+
+int shards_del_line (t_shards* s, t_line* line)
+{
+    t_shard* w;
+    int i;
+
+    pthread_mutex_lock (&s->lock);
+    i = find (s, line);
+    if (i < 0 || s->map[i].shard < 0) {
+        pthread_mutex_unlock (&s->lock);
+        return 0;
+    }
+    w = s->map[i].at >= 0 ? s->w + s->map[i].at : NULL;
+    if (w && pthread_equal (pthread_self (), w->th)) {
+        // from the holder's own callback: it cannot wait for itself
+        s->w[s->map[i].shard].nlines--;
+        reactor_del_line (&w->r, line);
+        drop (s, i);
+        pthread_mutex_unlock (&s->lock);
+        return 1;
+    }
+    if (!retarget (s, i, -1)) {
+        pthread_mutex_unlock (&s->lock);
+        return 0;
+    }
+    while (find (s, line) >= 0)
+        pthread_cond_wait (&s->cond, &s->lock);
+    pthread_mutex_unlock (&s->lock);
+    return 1;
+}
+
+
+int shards_line_owner (t_shards* s, t_line* line)
+{
+    int i;
+    pthread_mutex_lock (&s->lock);
+    i = find (s, line);
+    i = i < 0 ? -1 : s->map[i].shard;
+    pthread_mutex_unlock (&s->lock);
+    return i;
+}
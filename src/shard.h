@@ -0,0 +1,88 @@
+/*
+ * libtrivdl shards: lines spread over reactors in worker threads,
+ * POSIX (Linux) only.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "libtrivdl.h"
+#include "reactor.h"
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// each worker thread runs its own reactor, and callbacks of a line run
+// in the worker owning it. lines are handed to workers by commands, so
+// a line moves between reactor loops, never in the middle of its I/O:
+// undecoded bytes and partly written frame stay in t_line, the rest
+// stays in the kernel.
+// from a callback, touch lines of other workers only via submit_frame()
+// (SUBMITQLEN) or shards_move_line().
+// a line its reactor removes by itself (end of file, hangup, EXIT_A_M in
+// line flags) leaves the shards too, as after shards_del_line()
+
+struct s_shard_cmd;
+struct s_shards;
+
+typedef struct {
+    t_reactor r;
+    pthread_t th;
+    int cpu;            // pinned to, or -1
+    int evfd;           // wakes the reactor for commands
+    struct s_shards* pool;
+    // under pool lock
+    struct s_shard_cmd* cmds;
+    int ncmds, maxcmds;
+    int nlines;         // lines assigned, incl. in transit
+} t_shard;
+
+typedef struct s_shards {
+    t_shard* w;
+    int n;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    // some line is taken back
+    // each line goes to shard, and is held by at (-1 in transit)
+    struct {
+        t_line* line;
+        int shard;      // -1: to be taken back
+        int at;
+        bool moving;    // CMD_MOVE is queued to at
+    } *map;
+    int nmap, maxmap;
+    // a worker could not take a line handed to it by shards_add_line()
+    // or shards_move_line(): the line is in no worker any more. called
+    // in that worker. NULL, set it after init_shards()
+    void (*cb_failed) (struct s_shards* s, t_line* line);
+} t_shards;
+
+// start n workers (n < 1: one per online CPU), with pin each bound
+// to CPU i % CPUs. returns 1 on success
+int init_shards (t_shards* s, int n, bool pin);
+// stop and join workers; lines are left open
+void close_shards (t_shards* s);
+// hand initialized line to worker (-1: the one with fewest lines).
+// returns the worker, or -1 on error. the worker adds it to its reactor
+// later, if that fails the line is dropped and cb_failed is called
+int shards_add_line (t_shards* s, t_line* line, int shard);
+// move line to another worker; returns at once (1), the line's
+// callbacks run in the old worker until it gets the command
+int shards_move_line (t_shards* s, t_line* line, int shard);
+// take line back; it is not in any worker on return. returns 1 on success.
+// from a worker, do not wait for a worker which may wait for this one.
+// from the line's own callback, do not free it there (see reactor.h)
+int shards_del_line (t_shards* s, t_line* line);
+// worker owning the line, or -1
+int shards_line_owner (t_shards* s, t_line* line);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
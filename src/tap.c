@@ -0,0 +1,229 @@
+/*
+ * libtrivdl tap implementation.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+#include "tap.h"
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+
+#define PCAP_MAGIC_NS   0xa1b23c4d
+#define PCAP_FILEHDR    24
+#define PCAP_RECHDR     16
+
+typedef struct {
+    uint32_t magic;
+    uint16_t major, minor;
+    int32_t thiszone;
+    uint32_t sigfigs, snaplen, linktype;
+} t_pcap_hdr;
+
+typedef struct {
+    uint32_t sec, nsec, incl, orig;
+} t_pcap_rec;
+
+
+// copy into ring at position pos, wrapping around
+static void ring_put (t_tap* t, uint64_t pos, const void* src, int len)
+{
+    int i = pos & (TAP_RING - 1);
+    int n = TAP_RING - i < len ? TAP_RING - i : len;
+    memcpy (t->ring + i, src, n);
+    memcpy (t->ring, (const uc*)src + n, len - n);
+}
+
+
+// write what the ring holds; 0 if it was empty
+static int tap_flush (t_tap* t)
+{
+    uint64_t head = t->head;
+    uint64_t tail = __atomic_load_n (&t->tail, __ATOMIC_ACQUIRE);
+    int i, n, w;
+
+    if (head == tail)
+        return 0;
+    while (head != tail) {
+        i = head & (TAP_RING - 1);
+        n = tail - head < (uint64_t)(TAP_RING - i) ? (int)(tail - head) : TAP_RING - i;
+        w = write (t->fd, t->ring + i, n);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            err("tap: write: %s\n", strerror(errno));
+            head = tail; // lost, the file is cut
+            break;
+        }
+        head += w;
+    }
+    __atomic_store_n (&t->head, head, __ATOMIC_RELEASE);
+    return 1;
+}
+
+
+static void* tap_run (void* arg)
+{
+    t_tap* t = arg;
+    struct timespec ts = { 0, TAP_FLUSH * 1000000L };
+    int stop;
+
+    for (;;) {
+        stop = __atomic_load_n (&t->stop, __ATOMIC_ACQUIRE);
+        if (!tap_flush (t)) {
+            if (stop)
+                break;
+            nanosleep (&ts, NULL);
+        }
+    }
+    return NULL;
+}
+
+
+int init_tap (t_tap* t, const char* path)
+{
+    t_pcap_hdr h = { PCAP_MAGIC_NS, 2, 4, 0, 0, 65535, TAP_LINKTYPE };
+
+    memset (t, 0, sizeof(*t));
+    t->fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (t->fd < 0) {
+        err("tap: %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    t->ring = malloc (TAP_RING);
+    if (!t->ring || write (t->fd, &h, PCAP_FILEHDR) != PCAP_FILEHDR) {
+        err("tap: cannot start %s\n", path);
+        goto fail;
+    }
+    if (pthread_create (&t->th, NULL, tap_run, t)) {
+        err("tap: cannot start writer\n");
+        goto fail;
+    }
+    return 1;
+fail:
+    free (t->ring);
+    close (t->fd);
+    return 0;
+}
+
+
+void close_tap (t_tap* t)
+{
+    __atomic_store_n (&t->stop, 1, __ATOMIC_RELEASE);
+    pthread_join (t->th, NULL);
+    close (t->fd);
+    free (t->ring);
+    t->ring = NULL;
+}
+
+
+void tap_record (t_tap* t, t_line* line, uc dir, const uc* data, int len)
+{
+    struct timespec ts;
+    t_pcap_rec r;
+    uc h[TAP_HDR];
+    uint64_t tail = t->tail;
+    int need = PCAP_RECHDR + TAP_HDR + len;
+
+    if (TAP_RING - (tail - __atomic_load_n (&t->head, __ATOMIC_ACQUIRE))
+            < (uint64_t)need) {
+        t->dropped++;
+        return;
+    }
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    r.sec = ts.tv_sec;
+    r.nsec = ts.tv_nsec;
+    r.incl = r.orig = TAP_HDR + len;
+    h[0] = dir;
+    h[1] = 0;
+    h[2] = (uc)LFD;
+    h[3] = (uc)(LFD >> 8);
+    ring_put (t, tail, &r, PCAP_RECHDR);
+    ring_put (t, tail + PCAP_RECHDR, h, TAP_HDR);
+    ring_put (t, tail + PCAP_RECHDR + TAP_HDR, data, len);
+    __atomic_store_n (&t->tail, tail + need, __ATOMIC_RELEASE);
+    t->records++;
+}
+
+
+uc* capture_load (const char* path, size_t* size)
+{
+    t_pcap_hdr h;
+    FILE* f = fopen (path, "rb");
+    uc* buf = NULL;
+    long n;
+
+    if (!f) {
+        err("%s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (fseek (f, 0, SEEK_END) || (n = ftell (f)) < PCAP_FILEHDR
+            || fseek (f, 0, SEEK_SET) || !(buf = malloc (n))
+            || fread (buf, 1, n, f) != (size_t)n) {
+        err("%s: cannot read\n", path);
+        goto fail;
+    }
+    memcpy (&h, buf, PCAP_FILEHDR);
+    if (h.magic != PCAP_MAGIC_NS || h.linktype != TAP_LINKTYPE) {
+        err("%s: not a tap capture\n", path);
+        goto fail;
+    }
+    fclose (f);
+    *size = n;
+    return buf;
+fail:
+    free (buf);
+    fclose (f);
+    return NULL;
+}
+
+
+int capture_next (const uc* buf, size_t size, size_t* off, t_tap_rec* rec)
+{
+    t_pcap_rec r;
+    const uc* p;
+
+    if (*off < PCAP_FILEHDR)
+        *off = PCAP_FILEHDR;
+    if (size - *off < PCAP_RECHDR)
+        return 0;
+    memcpy (&r, buf + *off, PCAP_RECHDR);
+    if (r.incl < TAP_HDR || size - *off - PCAP_RECHDR < r.incl)
+        return 0; // cut
+    p = buf + *off + PCAP_RECHDR;
+    rec->ns = r.sec * 1000000000ULL + r.nsec;
+    rec->dir = p[0];
+    rec->id = p[2] | p[3] << 8;
+    rec->data = p + TAP_HDR;
+    rec->len = r.incl - TAP_HDR;
+    *off += PCAP_RECHDR + r.incl;
+    return 1;
+}
+
+
+long capture_replay (t_line* line, const uc* buf, size_t size, int id,
+        uc dir, bool bytewise)
+{
+    t_tap_rec rec;
+    size_t off = 0;
+    long total = 0;
+    int i, n;
+
+    while (capture_next (buf, size, &off, &rec)) {
+        if (rec.dir != dir || (id >= 0 && rec.id != id))
+            continue;
+        if (bytewise) {
+            for (i = 0; i < rec.len && !(LRFLAGS & READY); i++)
+                incoming_char (line, rec.data[i]);
+            n = i;
+        } else {
+            n = incoming_chars (line, (uc*)rec.data, rec.len);
+        }
+        total += n;
+        if (n < rec.len)
+            break;
+    }
+    return total;
+}
@@ -0,0 +1,81 @@
+/*
+ * libtrivdl tap: capture of wire bytes to a pcap file, and its replay,
+ * POSIX only.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+#ifndef TAP_H
+#define TAP_H
+
+#include "libtrivdl.h"
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// set line->tap, and the machine of the line (async_machine, reactor,
+// uring) records every chunk it reads or writes, as it is on the wire.
+// a record goes to a ring buffer, and a writer thread of the tap puts
+// it to the file, so the machine makes no syscalls for it; records
+// which do not fit in the ring are counted in dropped.
+// a tap is fed by one thread: lines of one machine may share it.
+//
+// file is pcap (nanosecond timestamps, CLOCK_MONOTONIC) of LINKTYPE_USER0,
+// each packet starts with TAP_HDR bytes: direction (TAP_RX, TAP_TX), 0,
+// fd of the line (2 bytes, little endian)
+#define TAP_LINKTYPE    147
+#define TAP_HDR         4
+#define TAP_RX          0
+#define TAP_TX          1
+#ifndef TAP_RING
+#define TAP_RING        (1 << 20)   // bytes, power of two
+#endif
+#define TAP_FLUSH       10          // ms, writer thread sleep when idle
+
+typedef struct s_tap {
+    int fd;
+    uc* ring;
+    // producer appends at tail, writer thread takes from head
+    volatile uint64_t head, tail;
+    volatile int stop;
+    pthread_t th;
+    unsigned long records, dropped;
+} t_tap;
+
+// create capture file and start its writer. returns 1 on success
+int init_tap (t_tap* t, const char* path);
+// write the rest and close; detach from lines first
+void close_tap (t_tap* t);
+// record bytes of line in direction dir; called by machines
+void tap_record (t_tap* t, t_line* line, uc dir, const uc* data, int len);
+
+// replay
+typedef struct {
+    uint64_t ns;        // timestamp
+    uc dir;
+    uint16_t id;        // fd of the line
+    const uc* data;
+    int len;
+} t_tap_rec;
+
+// read capture file into memory (free() it), NULL if it is not a tap
+// capture of this host's byte order
+uc* capture_load (const char* path, size_t* size);
+// next record after *off (0: the first); 0 at the end
+int capture_next (const uc* buf, size_t size, size_t* off, t_tap_rec* rec);
+// feed bytes of records in direction dir of line id (-1: any) to line,
+// as if received: by incoming_chars(), or incoming_char() each if bytewise.
+// stops at a record user code did not take whole (it holds rx frame).
+// returns bytes fed
+long capture_replay (t_line* line, const uc* buf, size_t size, int id,
+        uc dir, bool bytewise);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,215 @@
+/*
+ * libtrivdl timer wheel implementation.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+#include "timer.h"
+// INFINITY
+#include <math.h>
+#include <time.h>
+
+// busy bitmaps are uint64_t
+#if TIMER_SLOTS != 64
+#error "TIMER_SLOTS must be 64"
+#endif
+
+#define SHIFT(l)    (TIMER_BITS * (l))
+#define SLOTNDX(v,l)    (((v) >> SHIFT(l)) & (TIMER_SLOTS - 1))
+#define SPAN        ((uint64_t)1 << SHIFT(TIMER_LEVELS))
+
+
+static uint64_t clock_ns ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+void init_wheel (t_wheel* w)
+{
+    memset (w, 0, sizeof(*w));
+    w->now = clock_ns () / TIMER_TICK;
+}
+
+
+void init_timer (t_timer* t, void (*cb) (t_timer* t), void* userdata)
+{
+    memset (t, 0, sizeof(*t));
+    t->cb = cb;
+    t->userdata = userdata;
+}
+
+
+// put timer (expires >= w->now) into the lowest level its delay fits:
+// slot of level l is reached when the time of its 64^l ticks begins,
+// then its timers move down, and level 0 slots fire
+static void place (t_wheel* w, t_timer* t)
+{
+    uint64_t e = t->expires;
+    uint64_t d = e - w->now;
+    t_timer** head;
+    int l = 0, i;
+
+    while (l < TIMER_LEVELS - 1 && d >> SHIFT(l + 1))
+        l++;
+    if (d >= SPAN)
+        e = w->now + SPAN - 1; // waits in the farthest slot
+    i = SLOTNDX(e, l);
+    head = &w->slot[l][i];
+    t->next = *head;
+    if (t->next)
+        t->next->pprev = &t->next;
+    *head = t;
+    t->pprev = head;
+    t->at = l * TIMER_SLOTS + i;
+    w->busy[l] |= 1ULL << i;
+}
+
+
+void timer_start (t_wheel* w, t_timer* t, float delay, float period)
+{
+    uint64_t e;
+
+    timer_stop (t);
+    if (delay < 0)
+        delay = 0;
+    // never early: fires at the first tick that begins after delay
+    e = (clock_ns () + (uint64_t)(delay * 1e9) + TIMER_TICK - 1) / TIMER_TICK;
+    if (e <= w->now)
+        e = w->now + 1;
+    t->w = w;
+    t->expires = e;
+    t->period = 0;
+    if (period > 0) {
+        t->period = period * (1e9 / TIMER_TICK) + 0.5;
+        if (!t->period)
+            t->period = 1;
+    }
+    w->count++;
+    place (w, t);
+}
+
+
+void timer_stop (t_timer* t)
+{
+    t_wheel* w = t->w;
+    int l = t->at / TIMER_SLOTS, i = t->at % TIMER_SLOTS;
+
+    if (!t->pprev)
+        return;
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    t->pprev = NULL;
+    // the timer may be in a list being fired, then the slot is refilled
+    if (!w->slot[l][i])
+        w->busy[l] &= ~(1ULL << i);
+    w->count--;
+}
+
+
+// take slot list out of the wheel
+static t_timer* take (t_wheel* w, int l, int i)
+{
+    t_timer* list = w->slot[l][i];
+    w->slot[l][i] = NULL;
+    w->busy[l] &= ~(1ULL << i);
+    return list;
+}
+
+
+// wheel has come to tick w->now: move timers down, then fire level 0 slot
+static void wheel_tick (t_wheel* w)
+{
+    uint64_t now = w->now;
+    t_timer *list, *t;
+    int l;
+
+    for (l = 1; l < TIMER_LEVELS && !(now & (((uint64_t)1 << SHIFT(l)) - 1)); l++) {
+        list = take (w, l, SLOTNDX(now, l));
+        while ((t = list)) {
+            list = t->next;
+            place (w, t);
+        }
+    }
+    list = take (w, 0, SLOTNDX(now, 0));
+    if (!list)
+        return;
+    // callbacks may stop timers of the list: it is a list on its own
+    list->pprev = &list;
+    while ((t = list)) {
+        list = t->next;
+        if (list)
+            list->pprev = &list;
+        t->pprev = NULL;
+        w->count--;
+        if (t->period) {
+            // on schedule, unless periods were missed
+            t->expires += t->period;
+            if (t->expires <= now)
+                t->expires = now + t->period;
+            w->count++;
+            place (w, t);
+        }
+        t->cb (t);
+    }
+}
+
+
+// earliest tick when a slot is reached, or UINT64_MAX
+static uint64_t next_tick (t_wheel* w)
+{
+    uint64_t best = UINT64_MAX, b, at;
+    int l, c;
+
+    for (l = 0; l < TIMER_LEVELS; l++) {
+        b = w->busy[l];
+        if (!b)
+            continue;
+        // slots after the current one first, the current one is last
+        c = SLOTNDX(w->now, l) + 1;
+        c &= TIMER_SLOTS - 1;
+        if (c)
+            b = (b >> c) | (b << (64 - c));
+        at = ((w->now >> SHIFT(l)) + __builtin_ctzll (b) + 1) << SHIFT(l);
+        if (at < best)
+            best = at;
+    }
+    return best;
+}
+
+
+static double until (t_wheel* w, uint64_t ns)
+{
+    uint64_t t;
+    if (!w->count)
+        return INFINITY;
+    t = next_tick (w) * TIMER_TICK;
+    return t > ns ? (t - ns) * 1e-9 : 0;
+}
+
+
+double wheel_run (t_wheel* w)
+{
+    uint64_t ns = clock_ns ();
+    uint64_t now = ns / TIMER_TICK, t;
+
+    // empty ticks are skipped, so a long sleep costs nothing
+    while (w->count && (t = next_tick (w)) <= now) {
+        w->now = t;
+        wheel_tick (w);
+    }
+    if (now > w->now)
+        w->now = now;
+    return until (w, ns);
+}
+
+
+double wheel_next (t_wheel* w)
+{
+    return until (w, clock_ns ());
+}
@@ -0,0 +1,73 @@
+/*
+ * libtrivdl timers: hierarchical timer wheel on CLOCK_MONOTONIC,
+ * POSIX only.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "libtrivdl.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// a wheel is attached to a line (line->timers) and run by the machine
+// of the line (async_machine, reactor, uring) on every loop, so timers
+// fire on schedule however busy the line is, unlike cb_idle() which
+// is called only after timeout without I/O.
+// starting, stopping and firing a timer cost O(1), whatever the number
+// of timers; a timer fires within one tick after it is due.
+// TIMER_LEVELS wheels of TIMER_SLOTS slots each cover 2^24 ticks
+// (4.6 hours), later timers wait at the top level for their turn.
+// callbacks run in the machine thread, so they may touch the line
+// (e.g. fill wfr) as line callbacks do
+#define TIMER_TICK      1000000     // ns
+#define TIMER_BITS      6
+#define TIMER_SLOTS     (1 << TIMER_BITS)
+#define TIMER_LEVELS    4
+
+struct s_wheel;
+
+typedef struct s_timer {
+    // in slot list of the wheel; pprev is NULL while stopped
+    struct s_timer* next;
+    struct s_timer** pprev;
+    struct s_wheel* w;
+    uint16_t at;        // level * TIMER_SLOTS + slot
+    uint64_t expires;   // tick
+    uint32_t period;    // ticks, 0: one-shot
+    void (*cb) (struct s_timer* t);
+    void* userdata;
+} t_timer;
+
+typedef struct s_wheel {
+    uint64_t now;       // tick, timers due up to it have fired
+    t_timer* slot[TIMER_LEVELS][TIMER_SLOTS];
+    uint64_t busy[TIMER_LEVELS];    // bit per non-empty slot
+    int count;          // timers started
+} t_wheel;
+
+void init_wheel (t_wheel* w);
+void init_timer (t_timer* t, void (*cb) (t_timer* t), void* userdata);
+// (re)start timer to fire in delay seconds, and then every period
+// seconds if period > 0. a running timer is restarted
+void timer_start (t_wheel* w, t_timer* t, float delay, float period);
+// no effect on stopped timer; a timer may stop itself from its callback
+void timer_stop (t_timer* t);
+static inline bool timer_pending (t_timer* t) { return t->pprev != NULL; }
+// fire timers that are due; returns seconds until the wheel needs to
+// run again (a timer is due or moves down), INFINITY if there are no timers
+double wheel_run (t_wheel* w);
+// same without firing
+double wheel_next (t_wheel* w);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,480 @@
+/*
+ * libtrivdl C++ front end: frame geometry as template parameters,
+ * C++17. templates live in this header, but checksum blocks call
+ * crc16_update() and crc32c_update(), so link with the C library.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+#ifndef TRIVDL_HPP
+#define TRIVDL_HPP
+
+#include "libtrivdl.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
+// basic_line is the state machine of incoming_char(), incoming_chars() and
+// outgoing_char() with frame size, last index type (uint8_t or uint16_t,
+// as LONGFRAMES) and checksum fixed at compile time rather than by the
+// defines of the build. so one program may talk to peers of different
+// builds, e.g. a 64-byte MCU and a 4 KiB PC, and each geometry gets its
+// own code with constant sizes and offsets. frames are the same on the
+// wire: c_line<> has the geometry of the C build and talks to C lines.
+// the line has no fd, feed it bytes from your own I/O (or machine).
+// callbacks go to a handler, Handler<basic_line>: c_callbacks calls
+// C-style functions taking basic_line*, t_line_callbacks hands existing
+// t_callbacks (and L* macros) a t_line on a c_line, your own class may
+// have them inline
+
+namespace trivdl {
+
+enum class checksum { sum = CK_SUM, crc16 = CK_CRC16, crc32c = CK_CRC32C };
+
+namespace detail {
+
+// running value folded by step() or block(), then fin() gives what is
+// sent, as CK_ macros in libtrivdl.c. blocks use the C library
+template <checksum C> struct ck;
+
+template <> struct ck<checksum::sum> {
+    typedef uint8_t type;
+    static constexpr type init = 0;
+    static type step (type x, uc c) { return x + c; }
+    static type block (type x, const uc* p, int n)
+    {
+        while (n-- > 0)
+            x += *p++;
+        return x;
+    }
+    static type fin (type x) { return x; }
+};
+
+struct crc16_tab {
+    uint16_t t[256];
+    constexpr crc16_tab () : t()
+    {
+        for (int n = 0; n < 256; n++) {
+            uint16_t c = n << 8;
+            for (int k = 0; k < 8; k++)
+                c = (c & 0x8000) ? (c << 1) ^ 0x1021 : c << 1;
+            t[n] = c;
+        }
+    }
+};
+
+struct crc32c_tab {
+    uint32_t t[256];
+    constexpr crc32c_tab () : t()
+    {
+        for (int n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+            t[n] = c;
+        }
+    }
+};
+
+template <> struct ck<checksum::crc16> {
+    typedef uint16_t type;
+    static constexpr type init = 0xFFFF;
+    static constexpr crc16_tab tab {};
+    static type step (type x, uc c) { return (x << 8) ^ tab.t[(x >> 8) ^ c]; }
+    static type block (type x, const uc* p, int n) { return crc16_update (x, p, n); }
+    static type fin (type x) { return x; }
+};
+
+template <> struct ck<checksum::crc32c> {
+    typedef uint32_t type;
+    static constexpr type init = 0xFFFFFFFF;
+    static constexpr crc32c_tab tab {};
+    static type step (type x, uc c)
+    {
+#if defined(__SSE4_2__)
+        return _mm_crc32_u8 (x, c);
+#else
+        return (x >> 8) ^ tab.t[(x ^ c) & 0xff];
+#endif
+    }
+    static type block (type x, const uc* p, int n) { return crc32c_update (x, p, n); }
+    static type fin (type x) { return ~x; }
+};
+
+} // namespace detail
+
+
+// handler calling C-style functions, which may differ from line to line.
+// no cb_idle: basic_line has no machine to be idle in
+template <class Line>
+struct c_callbacks {
+    void (*cb_frame_rx_done) (uc status, Line* line) = nullptr;
+    void (*cb_frame_tx_done) (uc status, Line* line) = nullptr;
+
+    void frame_rx_done (uc status, Line& line)
+    {
+        if (cb_frame_rx_done)
+            cb_frame_rx_done (status, &line);
+    }
+    void frame_tx_done (uc status, Line& line)
+    {
+        if (cb_frame_tx_done)
+            cb_frame_tx_done (status, &line);
+    }
+};
+
+
+// handler calling t_callbacks written for the C build: they get a t_line
+// of their own (attach() sets its callbacks and userdata), with the frame
+// copied to its rfr or wfr before the callback, and flags, and a frame
+// built in wfr, copied back after it. so the line must have the geometry
+// of the C build, as c_line<t_line_callbacks>. rx frame held past the
+// callback is released on the basic_line (rfr.flags), not on the t_line
+template <class Line>
+struct t_line_callbacks {
+    t_line tl;
+
+    t_line_callbacks ()
+    {
+        std::memset (&tl, 0, sizeof(tl));
+        tl.fd = -1;
+        init_frame (&tl.rfr);
+        init_frame (&tl.wfr);
+    }
+
+#ifndef STATIC_CALLBACKS
+    void attach (const t_callbacks* cb, void* userdata = nullptr)
+    {
+        tl.cb = cb;
+        tl.userdata = userdata;
+    }
+#endif
+
+    void frame_rx_done (uc status, Line& l)
+    {
+        t_line* line = &tl;
+        if (!enter (l))
+            return;
+        // bytes of rfr so far, the whole frame if status is FROK
+        std::memcpy (tl.rfr.data, l.rfr.data,
+                l.rfr.next < MAXFRAMESIZE ? l.rfr.next : MAXFRAMESIZE);
+        tl.rfr.next = l.rfr.next;
+        X_DONE(cb_frame_rx_done, status);
+        leave (l);
+    }
+
+    void frame_tx_done (uc status, Line& l)
+    {
+        t_line* line = &tl;
+        if (!enter (l))
+            return;
+        std::memcpy (tl.wfr.data, l.wfr.data, l.wfr.last () + 1);
+        tl.wfr.next = l.wfr.next;
+        X_DONE(cb_frame_tx_done, status);
+        leave (l);
+    }
+
+private:
+    bool enter (Line& l)
+    {
+        static_assert (Line::maxframe == MAXFRAMESIZE
+                && std::is_same<typename Line::size_type, t_size>::value
+                && Line::ck_kind == (checksum)CHECKSUM,
+                "t_line_callbacks needs the geometry of the C build, c_line");
+#ifndef STATIC_CALLBACKS
+        if (!tl.cb)
+            return false;
+#endif
+        tl.rfr.flags = l.rfr.flags;
+        tl.wfr.flags = l.wfr.flags;
+        return true;
+    }
+
+    void leave (Line& l)
+    {
+        l.rfr.flags = tl.rfr.flags;
+        if ((tl.wfr.flags & READY) && !(l.wfr.flags & READY)) {
+            std::memcpy (l.wfr.data, tl.wfr.data, GETLAST(tl.wfr.data) + 1);
+            l.wfr.next = tl.wfr.next;
+        }
+        l.wfr.flags = tl.wfr.flags;
+    }
+};
+
+
+template <std::size_t MaxFrame, typename Size = uint8_t,
+        checksum Ck = checksum::sum, template <class> class Handler = c_callbacks>
+class basic_line {
+    typedef detail::ck<Ck> ck;
+
+public:
+    typedef Size size_type;
+    typedef typename ck::type cksum_type;
+
+    // geometry, as the defines of libtrivdl.h
+    static constexpr std::size_t lensize = sizeof(Size);
+    static constexpr std::size_t cksize = sizeof(cksum_type);
+    static constexpr std::size_t overhead = 1 + lensize + cksize;
+    static constexpr std::size_t maxframe = MaxFrame;
+    static constexpr std::size_t maxmsg = MaxFrame - overhead;
+    static constexpr std::size_t maxwire = 2 * MaxFrame;
+    static constexpr std::size_t message = 1 + lensize;    // MESSAGE
+    static constexpr uc delimiter = FRAMEDELIMITER;
+    static constexpr checksum ck_kind = Ck;
+
+    static_assert (std::is_same<Size, uint8_t>::value
+            || std::is_same<Size, uint16_t>::value, "last index is 1 or 2 bytes");
+    static_assert (MaxFrame > overhead, "frame holds no message");
+    // next may reach MaxFrame
+    static_assert (MaxFrame <= std::numeric_limits<Size>::max (),
+            "frame too long for last index type");
+
+    struct frame {
+        uc data[MaxFrame];
+        Size next;
+        uc flags;
+        cksum_type cs;  // rx: running checksum
+
+        std::size_t last () const
+        {
+            if (lensize == 1)
+                return data[1];
+            return data[1] | data[2] << 8;
+        }
+        void set_last (std::size_t v)
+        {
+            data[1] = (uc)v;
+            if (lensize == 2)
+                data[2] = (uc)(v >> 8);
+        }
+        std::size_t ckndx () const { return last () + 1 - cksize; }
+        std::size_t msglen () const { return ckndx () - message; }
+        uc* payload () { return data + message; }
+        const uc* payload () const { return data + message; }
+    };
+
+    frame rfr, wfr;
+    Handler<basic_line> cb;
+    void* userdata = nullptr;
+
+    basic_line ()
+    {
+        init_frame (rfr);
+        init_frame (wfr);
+    }
+
+    static void init_frame (frame& fr)
+    {
+        fr.next = 0;
+        fr.flags = 0;
+        fr.cs = ck::init;
+    }
+
+    // building frames, as frame_payload(), finalize_frame(), build_frame()
+    static uc* frame_payload (frame& fr)
+    {
+        init_frame (fr);
+        return fr.payload ();
+    }
+
+    static bool finalize_frame (frame& fr, std::size_t size)
+    {
+        cksum_type c;
+        if (size > maxmsg)
+            return false;
+        fr.set_last (message + size + cksize - 1);
+        fr.data[SIGNATURE] = delimiter;
+        c = ck::fin (ck::block (ck::init, fr.data + LASTNDX, fr.ckndx () - LASTNDX));
+        for (std::size_t k = 0; k < cksize; k++)
+            fr.data[fr.ckndx () + k] = (uc)(c >> (8 * k));
+        return true;
+    }
+
+    static bool build_frame (frame& fr, const void* src, std::size_t size)
+    {
+        if (size > maxmsg)
+            return false;
+        std::memcpy (frame_payload (fr), src, size);
+        return finalize_frame (fr, size);
+    }
+
+    // wire form of fr, dst must hold maxwire bytes. returns its length
+    static int stuff_frame (const frame& fr, uc* dst)
+    {
+        std::size_t n = fr.last ();
+        int o = 1;
+        dst[SIGNATURE] = delimiter;
+        for (std::size_t i = 1; i <= n; i++) {
+            // no branch: write it twice, keep the second copy for delimiter
+            dst[o] = dst[o + 1] = fr.data[i];
+            o += 1 + (fr.data[i] == delimiter);
+        }
+        return o;
+    }
+
+    // build message src in wfr and start sending it; false if wfr is busy
+    // or message is too long
+    bool send (const void* src, std::size_t size)
+    {
+        if ((wfr.flags & READY) || !build_frame (wfr, src, size))
+            return false;
+        wfr.next = SIGNATURE;
+        wfr.flags |= READY;
+        return true;
+    }
+
+    // next wire byte of wfr (READY). after the last one, wfr is released
+    // and frame_tx_done() is called, as the async machine does
+    uc outgoing_char ()
+    {
+        uc c;
+        if (wfr.next != SIGNATURE && wfr.data[wfr.next] == delimiter) {
+            if (wfr.flags & HFDFL) {
+                wfr.flags &= ~HFDFL;
+            } else {
+                wfr.flags |= HFDFL;
+                return delimiter;
+            }
+        }
+        c = wfr.data[wfr.next++];
+        if (wfr.next > wfr.last ())
+            tx_complete ();
+        return c;
+    }
+
+    // whole wfr was written in its stuffed form (stuff_frame())
+    void tx_complete ()
+    {
+        wfr.flags &= ~READY;
+        cb.frame_tx_done (FROK, *this);
+        wfr.next = SIGNATURE;
+    }
+
+    void incoming_char (uc c)
+    {
+        rx_char (c);
+    }
+
+    // as incoming_chars() of C: runs of message bytes are copied at once,
+    // stops early if user code holds rx frame; returns bytes consumed
+    int incoming_chars (const uc* buf, int len)
+    {
+        const uc* d;
+        int i = 0, run;
+
+        while (i < len && !(rfr.flags & READY)) {
+            if (rfr.next >= message && !(rfr.flags & HFDFL)) {
+                run = rfr.ckndx () - rfr.next;
+                if (run > len - i)
+                    run = len - i;
+                if (run > 0) {
+                    d = (const uc*)std::memchr (buf + i, delimiter, run);
+                    if (d)
+                        run = d - (buf + i);
+                    std::memcpy (rfr.data + rfr.next, buf + i, run);
+                    rfr.cs = ck::block (rfr.cs, buf + i, run);
+                    rfr.next += run;
+                    i += run;
+                    if (i == len)
+                        break;
+                }
+            }
+            rx_char (buf[i++]);
+        }
+        return i;
+    }
+
+private:
+    void rx_done (uc status)
+    {
+        rfr.flags |= READY;
+        cb.frame_rx_done (status, *this);
+    }
+
+    // data byte c has been stored at next-1
+    void rx_byte (uc c)
+    {
+        std::size_t p = rfr.next - 1;
+        cksum_type v = 0;
+
+        if (p < message - 1) {
+            rfr.cs = ck::step (rfr.cs, c);
+            return;
+        }
+        if (p == message - 1) {
+            rfr.cs = ck::step (rfr.cs, c);
+            if (rfr.last () >= MaxFrame || rfr.last () < message + cksize) {
+                err("invalid checksum position, frame skipped\n");
+                rx_done (FRBADFMT);
+                rfr.next = SIGNATURE;
+            }
+            return;
+        }
+        if (p < rfr.ckndx ()) {
+            rfr.cs = ck::step (rfr.cs, c);
+            return;
+        }
+        if (p == rfr.last ()) {
+            for (std::size_t k = cksize; k-- > 0; )
+                v = (v << 8) | rfr.data[rfr.ckndx () + k];
+            if ((cksum_type)ck::fin (rfr.cs) != v) {
+                err("checksum in frame (0x%lx) doesn't match calculated (0x%lx), frame skipped\n",
+                        (unsigned long)v, (unsigned long)(cksum_type)ck::fin (rfr.cs));
+                rx_done (FRBADSUM);
+            } else {
+                rx_done (FROK);
+            }
+            rfr.next = SIGNATURE;
+        }
+    }
+
+    void rx_char (uc c)
+    {
+        if (rfr.next == SIGNATURE) {
+            if (c == delimiter) {
+                rfr.data[rfr.next++] = c;
+                rfr.cs = ck::init;
+            }
+            return;
+        }
+        if (rfr.flags & HFDFL) {
+            rfr.flags &= ~HFDFL;
+            if (c == delimiter) {
+                rx_byte (c);
+                return;
+            }
+            // single delimiter: signature of a new frame
+            rx_done (FRBADFMT);
+            rfr.data[SIGNATURE] = delimiter;
+            rfr.next = SIGNATURE + 1;
+            rfr.cs = ck::init;
+        }
+        if (rfr.next >= MaxFrame) {
+            err("incoming frame buffer overrun\n");
+            rx_done (FRTOOLONG);
+            rfr.next = SIGNATURE;
+            return;
+        }
+        rfr.data[rfr.next++] = c;
+        if (c == delimiter) {
+            rfr.flags |= HFDFL;
+            return;
+        }
+        rx_byte (c);
+    }
+};
+
+// geometry of the C build
+template <template <class> class Handler = c_callbacks>
+using c_line = basic_line<MAXFRAMESIZE, t_size, (checksum)CHECKSUM, Handler>;
+
+} // namespace trivdl
+
+#endif
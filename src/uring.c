@@ -0,0 +1,705 @@
+/*
+ * libtrivdl io_uring backend implementation, on raw syscalls.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+#include "uring.h"
+#include "timer.h"
+#include "tap.h"
+#include <stdlib.h>
+// INFINITY
+#include <math.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// newer than some kernel headers
+#ifndef IORING_OP_READ_MULTISHOT
+#define IORING_OP_READ_MULTISHOT    49
+#endif
+
+#if URING_BUFS & (URING_BUFS - 1)
+#error "URING_BUFS must be a power of two"
+#endif
+
+// user_data of a request: t_uline pointer with kind in low bits
+#define UD_RX       0   // multishot read
+#define UD_TX       1   // write of a chain
+#define UD_POLL     2   // poll for room before the chain
+#define UD_SQ       3   // multishot poll of submit queue eventfd
+#define UD_CANCEL   4
+#define UD_KINDS    7   // t_uline is allocated, so aligned to 8 at least
+
+typedef struct s_uline {
+    t_line* line;
+    uint16_t bgid;
+    struct io_uring_buf_ring* br;   // provided buffers
+    uc* bufs;                       // URING_BUFS of RXCHUNK bytes
+    // rx: filled buffers not decoded yet, the first one from poff
+    uint16_t pend[URING_BUFS];
+    int plen[URING_BUFS];
+    int phead, pcount, poff;
+    bool rx_armed;
+    // tx: slots txdone..ntx-1 are not written yet, txsub requests out
+    struct {
+        uc data[MAXWIRESIZE];
+        int len, pos;
+        bool wfr;       // else fr goes to wfr when it is done
+        t_frame fr;
+    } tx[URING_TXDEPTH];
+    int ntx, txdone, txsub;
+    // frames built in wfr by callbacks while later slots were in flight
+    t_frame hold[URING_TXDEPTH];
+    int nhold;
+#ifdef LATENCY
+    uint64_t txstart;   // slot txdone started to be written
+#endif
+    bool txwait;        // fd was full: poll before writing
+    bool sq_armed;
+    int ops;            // requests in flight
+    bool gone;          // removed, waiting for ops
+    float idle_tmo;
+    double idle_at;
+} t_uline;
+
+
+static double mono ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static int sys_setup (unsigned entries, struct io_uring_params* p)
+{
+    return syscall (__NR_io_uring_setup, entries, p);
+}
+
+
+static int sys_register (int fd, unsigned op, void* arg, unsigned n)
+{
+    return syscall (__NR_io_uring_register, fd, op, arg, n);
+}
+
+
+static int sys_enter (t_uring* u, unsigned submit, unsigned wait, double tmo)
+{
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+
+    memset (&arg, 0, sizeof(arg));
+    if (wait && !isinf (tmo)) {
+        ts.tv_sec = (long long)tmo;
+        ts.tv_nsec = (long long)((tmo - ts.tv_sec) * 1e9);
+        arg.ts = (uintptr_t)&ts;
+    }
+    u->enters++;
+    return syscall (__NR_io_uring_enter, u->fd, submit, wait, flags,
+            wait ? &arg : NULL, wait ? sizeof(arg) : 0);
+}
+
+
+// SQEs the kernel has not consumed yet
+static unsigned pending_sqes (t_uring* u)
+{
+    return u->sq_local - __atomic_load_n (u->sq_head, __ATOMIC_ACQUIRE);
+}
+
+
+// publish SQEs to the kernel
+static void flush_sqes (t_uring* u)
+{
+    __atomic_store_n (u->sq_tail, u->sq_local, __ATOMIC_RELEASE);
+}
+
+
+static struct io_uring_sqe* get_sqe (t_uring* u)
+{
+    struct io_uring_sqe* sqe;
+    unsigned i;
+
+    if (u->sq_local - __atomic_load_n (u->sq_head, __ATOMIC_ACQUIRE) == URING_ENTRIES) {
+        // full: submit what we have
+        flush_sqes (u);
+        sys_enter (u, pending_sqes (u), 0, 0);
+    }
+    i = u->sq_local & *u->sq_mask;
+    sqe = (struct io_uring_sqe*)u->sqes + i;
+    memset (sqe, 0, sizeof(*sqe));
+    u->sq_array[i] = i;
+    u->sq_local++;
+    return sqe;
+}
+
+
+// opcode supported by the kernel
+static bool probe_op (int fd, int op)
+{
+    struct io_uring_probe* p;
+    size_t sz = sizeof(*p) + 256 * sizeof(struct io_uring_probe_op);
+    bool ok = false;
+
+    p = calloc (1, sz);
+    if (!p)
+        return false;
+    if (sys_register (fd, IORING_REGISTER_PROBE, p, 256) == 0 && op <= p->last_op)
+        ok = p->ops[op].flags & IO_URING_OP_SUPPORTED;
+    free (p);
+    return ok;
+}
+
+
+int init_uring (t_uring* u)
+{
+    struct io_uring_params p;
+    int fd;
+
+    memset (u, 0, sizeof(*u));
+    u->fd = -1;
+    memset (&p, 0, sizeof(p));
+    fd = sys_setup (URING_ENTRIES, &p);
+    if (fd < 0) {
+        wrn("io_uring_setup: %s\n", strerror(errno));
+        return 0;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)
+            || !probe_op (fd, IORING_OP_READ_MULTISHOT)) {
+        wrn("io_uring: kernel is too old\n");
+        close (fd);
+        return 0;
+    }
+    u->fd = fd;
+    u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (u->cq_size > u->sq_size)
+        u->sq_size = u->cq_size;
+    u->sq_ring = mmap (NULL, u->sq_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    u->sqes = mmap (NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (u->sq_ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+        err("io_uring mmap: %s\n", strerror(errno));
+        if (u->sq_ring != MAP_FAILED)
+            munmap (u->sq_ring, u->sq_size);
+        close (fd);
+        u->fd = -1;
+        return 0;
+    }
+    u->cq_ring = u->sq_ring; // single mmap
+    u->sq_head = (unsigned*)((uc*)u->sq_ring + p.sq_off.head);
+    u->sq_tail = (unsigned*)((uc*)u->sq_ring + p.sq_off.tail);
+    u->sq_mask = (unsigned*)((uc*)u->sq_ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*)((uc*)u->sq_ring + p.sq_off.array);
+    u->cq_head = (unsigned*)((uc*)u->cq_ring + p.cq_off.head);
+    u->cq_tail = (unsigned*)((uc*)u->cq_ring + p.cq_off.tail);
+    u->cq_mask = (unsigned*)((uc*)u->cq_ring + p.cq_off.ring_mask);
+    u->cqes = (uc*)u->cq_ring + p.cq_off.cqes;
+    u->sq_local = *u->sq_tail;
+    return 1;
+}
+
+
+static void free_uline (t_uring* u, t_uline* ul)
+{
+    struct io_uring_buf_reg reg;
+
+    if (ul->br) {
+        memset (&reg, 0, sizeof(reg));
+        reg.bgid = ul->bgid;
+        sys_register (u->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap (ul->br, URING_BUFS * sizeof(struct io_uring_buf));
+    }
+    free (ul->bufs);
+    free (ul);
+}
+
+
+void close_uring (t_uring* u)
+{
+    int i;
+    if (u->fd < 0)
+        return;
+    for (i = 0; i < u->nlines; i++)
+        free_uline (u, u->lines[i]);
+    free (u->lines);
+    munmap (u->sqes, URING_ENTRIES * sizeof(struct io_uring_sqe));
+    munmap (u->sq_ring, u->sq_size);
+    close (u->fd);
+    u->fd = -1;
+    u->lines = NULL;
+    u->nlines = u->maxlines = 0;
+}
+
+
+// give buffer back to the kernel
+static void recycle (t_uline* ul, uint16_t bid)
+{
+    uint16_t tail = ul->br->tail;
+    struct io_uring_buf* b = &ul->br->bufs[tail & (URING_BUFS - 1)];
+    b->addr = (uintptr_t)(ul->bufs + bid * RXCHUNK);
+    b->len = RXCHUNK;
+    b->bid = bid;
+    __atomic_store_n (&ul->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+
+// buffer group id no line has, or -1
+static int free_bgid (t_uring* u)
+{
+    uint16_t id = u->next_bgid;
+    long n;
+    int i;
+
+    for (n = 0; n <= UINT16_MAX; n++, id++) {
+        for (i = 0; i < u->nlines && u->lines[i]->bgid != id; i++)
+            ;
+        if (i == u->nlines) {
+            u->next_bgid = id + 1;
+            return id;
+        }
+    }
+    return -1;
+}
+
+
+int uring_add_line (t_uring* u, t_line* line)
+{
+    struct io_uring_buf_reg reg;
+    t_uline** lines;
+    t_uline* ul;
+    int i;
+
+    if (u->nlines == u->maxlines) {
+        lines = realloc (u->lines, (u->maxlines * 2 + 8) * sizeof(t_uline*));
+        if (!lines) {
+            err("uring: out of memory\n");
+            return 0;
+        }
+        u->lines = lines;
+        u->maxlines = u->maxlines * 2 + 8;
+    }
+    i = free_bgid (u);
+    if (i < 0) {
+        err("uring: no free buffer group\n");
+        return 0;
+    }
+    ul = calloc (1, sizeof(t_uline));
+    if (!ul || !(ul->bufs = malloc (URING_BUFS * RXCHUNK))) {
+        err("uring: out of memory\n");
+        free (ul);
+        return 0;
+    }
+    ul->line = line;
+    ul->bgid = i;
+    ul->br = mmap (NULL, URING_BUFS * sizeof(struct io_uring_buf),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ul->br == MAP_FAILED) {
+        ul->br = NULL;
+        free_uline (u, ul);
+        return 0;
+    }
+    memset (&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ul->br;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = ul->bgid;
+    if (sys_register (u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        wrn("io_uring: no buffer rings: %s\n", strerror(errno));
+        munmap (ul->br, URING_BUFS * sizeof(struct io_uring_buf));
+        ul->br = NULL;
+        free_uline (u, ul);
+        return 0;
+    }
+    for (i = 0; i < URING_BUFS; i++)
+        recycle (ul, i);
+    // as in async machine, first cb_idle() comes at once if there is no I/O
+    ul->idle_tmo = 0;
+    ul->idle_at = mono ();
+    u->lines[u->nlines++] = ul;
+    return 1;
+}
+
+
+static void rx_arm (t_uring* u, t_uline* ul)
+{
+    struct io_uring_sqe* sqe = get_sqe (u);
+    sqe->opcode = IORING_OP_READ_MULTISHOT;
+    sqe->fd = ul->line->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = ul->bgid;
+    sqe->off = -1;
+    sqe->user_data = (uintptr_t)ul | UD_RX;
+    ul->rx_armed = true;
+    ul->ops++;
+}
+
+
+// decode filled buffers while user code does not hold rx frame
+static void rx_feed (t_uline* ul)
+{
+    t_line* line = ul->line;
+    int len;
+
+    line_rx_drain (line); // left by async machine before
+    while (ul->pcount && !(LRFLAGS & READY) && line->rxpos == line->rxlen) {
+        len = ul->plen[ul->phead];
+        ul->poff += incoming_chars (line,
+                ul->bufs + ul->pend[ul->phead] * RXCHUNK + ul->poff, len - ul->poff);
+        if (ul->poff < len)
+            break; // user code holds rx frame
+        recycle (ul, ul->pend[ul->phead]);
+        ul->phead = (ul->phead + 1) & (URING_BUFS - 1);
+        ul->pcount--;
+        ul->poff = 0;
+    }
+}
+
+
+// submit slots txdone..ntx-1 as linked writes
+static void tx_submit (t_uring* u, t_uline* ul)
+{
+    struct io_uring_sqe* sqe;
+    int i;
+
+    if (ul->txwait) {
+        sqe = get_sqe (u);
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = ul->line->fd;
+        sqe->poll32_events = POLLOUT;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = (uintptr_t)ul | UD_POLL;
+        ul->txsub++;
+        ul->ops++;
+        ul->txwait = false;
+    }
+    for (i = ul->txdone; i < ul->ntx; i++) {
+        sqe = get_sqe (u);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = ul->line->fd;
+        sqe->addr = (uintptr_t)(ul->tx[i].data + ul->tx[i].pos);
+        sqe->len = ul->tx[i].len - ul->tx[i].pos;
+        sqe->off = -1;
+        if (i < ul->ntx - 1)
+            sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = (uintptr_t)ul | UD_TX;
+        ul->txsub++;
+        ul->ops++;
+    }
+}
+
+
+// copy frame, as txq_next() does
+static void copy_frame (t_frame* dst, t_frame* src)
+{
+    memcpy (dst->data, src->data, GETLAST(src->data) + 1);
+#ifdef LATENCY
+    dst->built = src->built;
+#endif
+}
+
+
+static void tx_slot (t_uline* ul, t_frame* fr, bool wfr)
+{
+    int i = ul->ntx++;
+    ul->tx[i].len = stuff_frame (fr, ul->tx[i].data);
+    ul->tx[i].pos = 0;
+    ul->tx[i].wfr = wfr;
+    if (!wfr)
+        copy_frame (&ul->tx[i].fr, fr);
+}
+
+
+// new batch: frames held from the last one, wfr, then frames of TX queue
+static void tx_stage (t_uring* u, t_uline* ul)
+{
+    t_line* line = ul->line;
+    int i;
+
+    if (ul->ntx)
+        return; // batch in flight
+#if TXQLEN > 0
+    txq_next (line);
+#endif
+#if SUBMITQLEN > 0
+    submitq_next (line);
+#endif
+    for (i = 0; i < ul->nhold; i++)
+        tx_slot (ul, ul->hold + i, false);
+    ul->nhold = 0;
+    // wfr is written in place only as the first slot, the frames
+    // of later slots pass through it when they are done
+    if ((LWFLAGS & READY) && !ul->ntx)
+        tx_slot (ul, LWFR, true);
+#if TXQLEN > 0
+    // queued frames go after wfr
+    while (ul->ntx < URING_TXDEPTH && line->txqcount
+            && (!(LWFLAGS & READY) || ul->tx[0].wfr)) {
+        tx_slot (ul, line->txq + line->txqhead, false);
+        if (++line->txqhead == TXQLEN)
+            line->txqhead = 0;
+        line->txqcount--;
+    }
+#endif
+    if (ul->ntx) {
+        ul->txdone = 0;
+#ifdef LATENCY
+        ul->txstart = lat_now ();
+#endif
+        tx_submit (u, ul);
+    }
+}
+
+
+// frame of slot is written: it is in wfr for cb_frame_tx_done(),
+// as in the other machines
+static void tx_done (t_uline* ul, int i)
+{
+    t_line* line = ul->line;
+
+    if (!ul->tx[i].wfr) {
+        // a frame built in wfr by an earlier callback waits for next batch
+        if (LWFLAGS & READY)
+            copy_frame (ul->hold + ul->nhold++, LWFR);
+        copy_frame (LWFR, &ul->tx[i].fr);
+    }
+#ifdef LATENCY
+    line->lat.tx_first = ul->txstart;
+    line->lat.tx_last = ul->txstart = lat_now (); // next slot starts now
+    if (line->wfr.built)
+        lat_add (&line->lat.queue, line->lat.tx_first - line->wfr.built);
+    lat_add (&line->lat.tx, line->lat.tx_last - line->lat.tx_first);
+#endif
+#if STATS
+    line->stats.tx_frames++;
+    line->stats.tx_payload += MSGLEN(LWDATA);
+    line->stats.tx_stuffed += ul->tx[i].len - (LWLAST + 1);
+#endif
+    LWFLAGS &= ~READY;
+    X_DONE(cb_frame_tx_done, FROK);
+    LWNEXT = SIGNATURE;
+}
+
+
+// line is removed: cancel its requests, free it when they are done
+static void line_gone (t_uring* u, t_uline* ul)
+{
+    struct io_uring_sqe* sqe;
+
+    if (ul->gone)
+        return; // cancelled already
+    ul->gone = true;
+    if (!ul->ops)
+        return;
+    sqe = get_sqe (u);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = ul->line->fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = (uintptr_t)ul | UD_CANCEL;
+    ul->ops++;
+#if SUBMITQLEN > 0
+    // multishot poll of sqfd would keep the line forever
+    if (ul->sq_armed) {
+        sqe = get_sqe (u);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = ul->line->sqfd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = (uintptr_t)ul | UD_CANCEL;
+        ul->ops++;
+    }
+#endif
+}
+
+
+static void complete (t_uring* u, struct io_uring_cqe* cqe, double now)
+{
+    t_uline* ul = (t_uline*)(uintptr_t)(cqe->user_data & ~(uint64_t)UD_KINDS);
+    t_line* line = ul->line;
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    int res = cqe->res;
+    int i;
+
+    if (!more)
+        ul->ops--;
+    switch (cqe->user_data & UD_KINDS) {
+    case UD_RX:
+        if (!more)
+            ul->rx_armed = false;
+        if (res > 0) {
+            i = (ul->phead + ul->pcount++) & (URING_BUFS - 1);
+            ul->pend[i] = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            ul->plen[i] = res;
+            if (line->tap)
+                tap_record (line->tap, line, TAP_RX,
+                        ul->bufs + ul->pend[i] * RXCHUNK, res);
+            ul->idle_at = now + ul->idle_tmo;
+            if (!ul->gone)
+                rx_feed (ul);
+        } else if (res == 0) {
+            err("line %d: end of file\n", LFD);
+            line_gone (u, ul);
+        } else if (res != -ENOBUFS && res != -EINTR && res != -EAGAIN
+                && res != -ECANCELED) {
+            err("line %d: read: %s\n", LFD, strerror(-res));
+            line_gone (u, ul);
+        }
+        break;
+    case UD_POLL:
+        ul->txsub--;
+        if (res < 0 && res != -ECANCELED) {
+            err("line %d: poll: %s\n", LFD, strerror(-res));
+            line_gone (u, ul);
+        }
+        break;
+    case UD_TX:
+        ul->txsub--;
+        if (res == -EAGAIN || res == -EINTR) {
+            ul->txwait = true; // fd is full, the rest is cancelled
+        } else if (res < 0 && res != -ECANCELED) {
+            err("line %d: write: %s\n", LFD, strerror(-res));
+            line_gone (u, ul);
+        } else if (res > 0) {
+            // chain completes in order
+            i = ul->txdone;
+            if (line->tap)
+                tap_record (line->tap, line, TAP_TX,
+                        ul->tx[i].data + ul->tx[i].pos, res);
+            ul->tx[i].pos += res;
+            ul->idle_at = now + ul->idle_tmo;
+#if STATS
+            line->stats.tx_bytes += res;
+#endif
+            if (ul->tx[i].pos == ul->tx[i].len) {
+                ul->txdone++;
+                if (!ul->gone)
+                    tx_done (ul, i);
+            }
+        }
+        break;
+    case UD_SQ:
+        if (!more)
+            ul->sq_armed = false;
+#if SUBMITQLEN > 0
+        if (res > 0)
+            submitq_clear (line);
+#endif
+        break;
+    }
+    // the whole chain is done, a short write breaks it
+    if (ul->ntx && !ul->txsub && !ul->gone) {
+        if (ul->txdone < ul->ntx)
+            tx_submit (u, ul);
+        else
+            ul->ntx = ul->txdone = 0;
+    }
+}
+
+
+#if SUBMITQLEN > 0
+static void sq_arm (t_uring* u, t_uline* ul)
+{
+    struct io_uring_sqe* sqe = get_sqe (u);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = ul->line->sqfd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = (uintptr_t)ul | UD_SQ;
+    ul->sq_armed = true;
+    ul->ops++;
+}
+#endif
+
+
+int uring_run (t_uring* u)
+{
+    struct io_uring_cqe* cqes = u->cqes;
+    unsigned head;
+    double now, next, at;
+    t_uline* ul;
+    t_line* line;
+    int i, rc;
+
+    u->rflags &= ~EXIT_A_M;
+    while (u->nlines && !(u->rflags & EXIT_A_M)) {
+        // after callbacks: exit requests, new interest, idle
+        now = mono ();
+        next = INFINITY;
+        // backwards: removal moves the last line to the current slot
+        for (i = u->nlines - 1; i >= 0; i--) {
+            ul = u->lines[i];
+            line = ul->line;
+            if (!ul->gone && line->timers)
+                wheel_run (line->timers);
+            if (!ul->gone && ul->idle_at <= now) {
+                ul->idle_tmo = X_IDLE(line);
+                ul->idle_at = now + ul->idle_tmo;
+            }
+            if (!ul->gone && (LFLAGS & EXIT_A_M)) {
+                LFLAGS &= ~EXIT_A_M;
+                line_gone (u, ul);
+            }
+            if (ul->gone) {
+                if (!ul->ops) {
+                    free_uline (u, ul);
+                    u->lines[i] = u->lines[--u->nlines];
+                }
+                continue;
+            }
+            rx_feed (ul);
+            // multishot read stops when buffers run out
+            if (!ul->rx_armed && ul->pcount < URING_BUFS)
+                rx_arm (u, ul);
+            tx_stage (u, ul);
+#if SUBMITQLEN > 0
+            if (!ul->sq_armed)
+                sq_arm (u, ul);
+#endif
+            if (ul->idle_at < next)
+                next = ul->idle_at;
+            if (line->timers) {
+                at = now + wheel_next (line->timers);
+                if (at < next)
+                    next = at;
+            }
+        }
+        if (!u->nlines)
+            break;
+        // submit and wait in one syscall
+        flush_sqes (u);
+        rc = sys_enter (u, pending_sqes (u), 1, next < now ? 0 : next - now);
+        if (rc < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+            perror("io_uring_enter()");
+            return errno;
+        }
+        now = mono ();
+        head = *u->cq_head;
+        while (head != __atomic_load_n (u->cq_tail, __ATOMIC_ACQUIRE)) {
+            complete (u, (struct io_uring_cqe*)cqes + (head & *u->cq_mask), now);
+            head++;
+            __atomic_store_n (u->cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+    return 0;
+}
+
+
+int uring_machine (t_line* line)
+{
+    t_uring u;
+    int rc;
+
+    if (!init_uring (&u))
+        return async_machine (line);
+    if (!uring_add_line (&u, line)) {
+        close_uring (&u);
+        return async_machine (line);
+    }
+    rc = uring_run (&u);
+    close_uring (&u);
+    return rc;
+}
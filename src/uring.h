@@ -0,0 +1,75 @@
+/*
+ * libtrivdl io_uring backend: async machine for many lines without
+ * a readiness syscall, Linux 6.7 or later.
+ *
+ * Copyright 2018 Alexander Kulak.
+ * This file is licensed under the MIT license.
+ * See the LICENSE file in the project root for more information.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include "libtrivdl.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// each line has a multishot read into a ring of provided buffers
+// (URING_BUFS of RXCHUNK bytes), so data comes with its completion,
+// and one io_uring_enter() both submits and waits. TX writes the whole
+// stuffed frame (as TXFRAME) of wfr, along with up to URING_TXDEPTH-1
+// frames taken from the TX queue, as a chain of linked writes.
+// each frame is copied to wfr when it is written, so cb_frame_tx_done()
+// sees it there as in the other machines. a frame that cb_frame_tx_done()
+// builds in wfr goes after queued frames already handed to the kernel,
+// and TXDRAIN is not supported.
+// while user code holds rx frame, read data waits in the buffers;
+// when they run out, the kernel stops reading until they are decoded.
+#ifndef URING_BUFS
+#define URING_BUFS      16      // power of two
+#endif
+#ifndef URING_TXDEPTH
+#define URING_TXDEPTH   4
+#endif
+#define URING_ENTRIES   256     // submission queue
+
+struct s_uline;
+
+typedef struct {
+    int fd;                 // io_uring
+    // rings mapped from the kernel
+    void* sq_ring;
+    void* cq_ring;
+    void* sqes;
+    size_t sq_size, cq_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    void* cqes;
+    unsigned sq_local;      // tail of SQEs not yet submitted
+    struct s_uline** lines; // registered lines
+    int nlines, maxlines;
+    uint16_t next_bgid;     // tried first, ids of removed lines are reused
+    unsigned long enters;   // io_uring_enter() calls
+    uc rflags;              // EXIT_A_M
+} t_uring;
+
+// 1 on success, 0 if io_uring or a feature it needs is not available
+int init_uring (t_uring* u);
+void close_uring (t_uring* u); // lines are left open
+// register line (fd set, not running). 0 on failure, e.g. no buffer rings
+int uring_add_line (t_uring* u, t_line* line);
+// run until all lines are gone or EXIT_A_M is set in u->rflags;
+// EXIT_A_M in line flags removes that line, as in reactor.
+// bytes read ahead into the buffers of a removed line are dropped
+int uring_run (t_uring* u);
+// async_machine() on io_uring; it is async_machine() itself if
+// io_uring is not available
+int uring_machine (t_line* line);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif